@@ -18,22 +18,50 @@
  */
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/types.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <asm/types.h>
 #include <sys/signal.h>
 #include <getopt.h>
+#include <glob.h>
 #include <linux/hiddev.h>
+#include <linux/hidraw.h>
+#include <linux/input.h>
+#include <linux/usbdevice_fs.h>
+#include <linux/netlink.h>
 
-#include <iostream>
+#include <algorithm>
 #include <iomanip>
 #include <map>
+#include <random>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <sstream>
+#include <vector>
 #include <list>
+#include <deque>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <system_error>
+#include <thread>
+#include <string>
 
 using namespace std;
 
@@ -41,6 +69,9 @@ using namespace std;
 #define HID_MAX_USAGES			1024
 #define HID_MAX_APPLICATIONS	16
 
+// Maximum number of HID devices probed at the same time by --detect, or accessed at the same time otherwise
+#define DETECT_JOBS				8
+
 // Current version
 #define VERSION "0.4"
 
@@ -49,11 +80,50 @@ const int USAGE_MODE_GET = 0;
 const int USAGE_MODE_SET = 1;
 const int USAGE_MODE_DETECT = 2;
 const int USAGE_MODE_SETREL = 3;
+const int USAGE_MODE_DAEMON = 4;
+const int USAGE_MODE_WATCH = 5;
+
+// Results of opening and initialising a HID device
+const int PROBE_OK                        = 0;
+const int PROBE_OPEN_FAILED               = 1;
+const int PROBE_UNSUPPORTED               = 2;
+const int PROBE_NOT_MONITOR               = 3;
+const int PROBE_INIT_FAILED               = 4;
+
+// Kinds of HID device nodes --auto and --hotplug look for
+const int BACKEND_HIDDEV                  = 0;
+const int BACKEND_HIDRAW                  = 1;
+const int BACKEND_USBFS                   = 2;
+
+// Which hiddev ioctls move the brightness usages: one call per usage, or one call for all of them
+const int USAGE_IOCTLS_AUTO               = 0;
+const int USAGE_IOCTLS_SINGLE             = 1;
+const int USAGE_IOCTLS_MULTI              = 2;
+
+// What a brightness change waits for before it's reported: nothing, reading the brightness back, or the display
+// announcing it. By default absolute changes wait for nothing and relative ones read the brightness back.
+const int CONSISTENCY_DEFAULT             = -1;
+const int CONSISTENCY_NONE                = 0;
+const int CONSISTENCY_READBACK            = 1;
+const int CONSISTENCY_EVENT               = 2;
+
+// How long to wait for the display to announce a brightness change before reading it back, in milliseconds
+const int EVENT_TIMEOUT                   = 1000;
+
+// Names of the consistency levels, in the command line and the daemon protocol
+const char* const consistencyNames[]      = { "fire-and-forget", "readback", "event" };
+
+// How often --watch reads the brightness of displays which can't report changes as events, in milliseconds: right
+// after a change, and at most once things have been quiet for a while
+const int WATCH_POLL_MIN                  = 250;
+const int WATCH_POLL_MAX                  = 10000;
 
-// USB HID report ID for the monitor's brightness
+// USB HID report ID for the monitor's brightness, if the report descriptor doesn't tell
 const int BRIGHTNESS_CONTROL              = 1;
-// USB HID usage code for setting the brightness
+// USB HID usage code for setting the brightness, if the report descriptor doesn't tell
 const int USAGE_CODE                      = 0x820001;
+// USB HID usage of the brightness control: VESA Virtual Controls page (0x82), Brightness (0x10)
+const unsigned BRIGHTNESS_USAGE           = 0x820010;
 
 // Supported vendors
 const int APPLE                           = 0x05ac;
@@ -63,7 +133,6 @@ const int STUDIO_DISPLAY_27               = 0x1114;
 const int PRO_XDR_DISPLAY_32              = 0x9243;
 
 // Forward Declarations
-void init_device_database();
 void dump_supported();
 
 // Helpful declarations
@@ -71,37 +140,184 @@ typedef unsigned Vendor;
 typedef unsigned Product;
 
 struct DeviceId {
-    Product product;
-    Vendor  vendor;
-    string  description;
-    int     brightness_min;
-    int     brightness_max;
-
-    DeviceId (
-        Vendor vendor_, Product product_, string description_,
-        int brightness_min = 0, int brightness_max = 255
-    )
-        : product ( product_ )
-        , vendor ( vendor_ )
-        , description ( description_ )
-        , brightness_min ( brightness_min )
-        , brightness_max ( brightness_max )
+    Vendor      vendor;
+    Product     product;
+    const char* description;
+    int         brightness_min;
+    int         brightness_max;
+};
+
+struct VendorDesc {
+    Vendor      vendor;
+    const char* name;
+};
+
+/**
+ * The supported displays, by vendor and product. Constant tables need no initialisation when the program starts.
+ */
+const DeviceId supportedDevices[] = {
+    { APPLE, STUDIO_DISPLAY_27, "Apple Studio Display (2022, 27\")", 400, 60000 },
+    { APPLE, PRO_XDR_DISPLAY_32, "Apple Pro XDR Display (2019, 32\")", 400, 60000 },
+};
+
+const VendorDesc supportedVendors[] = {
+    { APPLE, "Apple" },
+};
+
+typedef vector< const char* > FileList;
+
+/**
+ * Where a display's brightness lives in its HID reports, and its range
+ */
+struct BrightnessControl {
+    int      report_id;
+    int      field_index;
+    int      usage_index;
+    unsigned usage_code;
+    int      minimum;
+    int      maximum;
+
+    // Brightness usages in a row from usage_index, e.g. one per backlight zone; all are written, the first is read
+    int      usage_count;
+
+    // Position in the raw feature report, for hidraw and usbfs
+    int      bit_offset;
+    int      bit_size;
+    int      report_length;
+    bool     exclusive;
+
+    // HID interface number, for usbfs
+    int      interface;
+
+    BrightnessControl()
+        : report_id ( BRIGHTNESS_CONTROL )
+        , field_index ( 0 )
+        , usage_index ( 0 )
+        , usage_code ( USAGE_CODE )
+        , minimum ( 0 )
+        , maximum ( 65535 )
+        , usage_count ( 1 )
+        , bit_offset ( 0 )
+        , bit_size ( 0 )
+        , report_length ( 0 )
+        , exclusive ( false )
+        , interface ( 0 )
     { }
+};
+
+struct Display;
+
+/**
+ * The operations on a HID device, as implemented by each way of accessing it: hiddev, hidraw, usbfs, or a simulated
+ * display.
+ *
+ * Functions returning bool or a file descriptor set errno on failure. Brightness reads and writes return 0 on success,
+ * otherwise the program exit status for the failed step, with errno set and a description suitable for perror() in
+ * failure.
+ */
+struct DeviceBackend {
+    virtual ~DeviceBackend() { }
+
+    /**
+     * Opens the device; by default the node itself
+     */
+    virtual int open ( const char* path, int open_mode );
+
+    /**
+     * Reads the driver version, if there is such a thing
+     */
+    virtual void version ( int, int* ) { }
+
+    virtual void device_info ( int fd, const char* path, hiddev_devinfo& device_info ) = 0;
+
+    /**
+     * Reads the USB serial number; by default from sysfs
+     */
+    virtual string serial ( int fd, const hiddev_devinfo& device_info );
+
+    /**
+     * Does the device implement the Monitor Control application (0x80)?
+     */
+    virtual bool is_monitor ( int fd, const hiddev_devinfo& device_info ) = 0;
+
+    /**
+     * Prepares an opened display for brightness reads and writes, and sets up its brightness control
+     */
+    virtual bool init ( Display& display ) = 0;
+
+    virtual int read_brightness ( Display& display, int& brightness, const char*& failure ) = 0;
 
-    bool operator < ( const DeviceId& other ) const
+    virtual int write_brightness ( Display& display, int brightness, const char*& failure ) = 0;
+
+    /**
+     * Makes the display report brightness changes as events; see watch_brightness()
+     *
+     * @return False if the device can't report events, with errno set
+     */
+    virtual bool watch_events ( Display& )
+    {
+        errno = ENOTSUP;
+
+        return false;
+    }
+
+    /**
+     * Waits for an event carrying the brightness, once watch_events() succeeded. Other events are dropped.
+     *
+     * @param deadline monotonic_ns() after which to give up
+     *
+     * @return 1 with the brightness set if one came, 0 if none came in time, -1 with errno set if waiting failed
+     */
+    virtual int next_event ( Display&, long long, int& )
     {
-        return ( vendor < other.vendor ) ||
-               ( vendor == other.vendor && product < other.product );
+        errno = ENOTSUP;
+
+        return -1;
     }
+
+    /**
+     * Gives up whatever init() acquired, before the display is closed
+     */
+    virtual void release ( Display& ) { }
+
+    virtual void close ( int fd );
 };
 
-typedef set<DeviceId> SupportedDevices;
-SupportedDevices supportedDevices;
+/**
+ * A HID device which has been opened, identified and initialised
+ */
+struct Display {
+    string            path;
+    int               fd;
+    DeviceBackend*    backend;
+    hiddev_devinfo    device_info;
+    string            serial;
+    const DeviceId*   device;
+    BrightnessControl control;
+
+    // Found in the detection cache, so known to be a supported monitor
+    bool              identified;
+    // Initialised the fast way, trusting the caches
+    bool              fast;
+    // The kernel holds the brightness report as the display last sent it (hiddev)
+    bool              report_fetched;
+    // Brightness changes are reported as events
+    bool              watching;
 
-typedef map<Vendor, string> SupportedVendors;
-SupportedVendors supportedVendors;
+    Display()
+        : fd ( -1 )
+        , backend ( 0 )
+        , device ( 0 )
+        , identified ( false )
+        , fast ( false )
+        , report_fetched ( false )
+        , watching ( false )
+    {
+        memset ( &device_info, 0, sizeof ( device_info ) );
+    }
+};
 
-typedef pair<Vendor, string> VendorDesc;
+typedef map<string, Display> DisplayTable;
 
 /**
  * Does it look like a number?
@@ -171,6 +387,37 @@ bool isPercent ( const char* str )
     return hasPercent;
 }
 
+/**
+ * Is this HID device argument a display name rather than a path?
+ *
+ * Displays can be named by their USB serial number as serial:<serial number>, or by an alias as @<alias>.
+ *
+ * @return Whether the argument is a display name.
+ */
+bool is_display_name ( const char* str )
+{
+    return str && ( str[0] == '@' || strncmp ( str, "serial:", 7 ) == 0 );
+}
+
+/**
+ * Looks a display up in the supported devices
+ *
+ * @param  vendor   USB vendor identifier
+ * @param  product  USB product identifier
+ *
+ * @return Pointer to DeviceId if it's supported, null pointer otherwise.
+ */
+const DeviceId* find_device ( Vendor vendor, Product product )
+{
+    for ( size_t i = 0; i < sizeof ( supportedDevices ) / sizeof ( supportedDevices[0] ); ++i ) {
+        if ( supportedDevices[i].vendor == vendor && supportedDevices[i].product == product ) {
+            return &supportedDevices[i];
+        }
+    }
+
+    return 0;
+}
+
 /**
  * Check if a HID device is supported and return a pointer to the corresponding DeviceId.
  *
@@ -181,12 +428,7 @@ const DeviceId* is_supported ( const hiddev_devinfo& device_info )
     Product product = device_info.product & 0xFFFF;
     Vendor vendor = device_info.vendor & 0xFFFF;
 
-    SupportedDevices::const_iterator i = supportedDevices.find ( DeviceId ( vendor, product, "" ) );
-    if ( i != supportedDevices.end() ) {
-        return &*i;
-    }
-
-    return 0;
+    return find_device ( vendor, product );
 }
 
 /**
@@ -199,28 +441,362 @@ const DeviceId* is_supported ( const hiddev_devinfo& device_info )
  */
 string description ( Vendor v, Product p )
 {
-    SupportedDevices::iterator it =
-        supportedDevices.find ( DeviceId ( v, p, "" ) );
-
-    if ( it != supportedDevices.end() ) {
-        return it->description;
-    }
+    const DeviceId* device = find_device ( v, p );
 
-    return "";
+    return device ? device->description : "";
 }
 
 /**
- * Is the USB vendor identifier known to this program?
+ * Get the name of a USB vendor known to this program
  *
  * @param  v  Vendor identifier
  *
- * @return True if the vendor is known to this program.
+ * @return The vendor's name, or a null pointer if the vendor is not known to this program.
  */
-bool known_vendor ( Vendor v )
+const char* vendor_name ( Vendor v )
 {
     v &= 0xFFFF;
 
-    return supportedVendors.find ( v ) != supportedVendors.end();
+    for ( size_t i = 0; i < sizeof ( supportedVendors ) / sizeof ( supportedVendors[0] ); ++i ) {
+        if ( supportedVendors[i].vendor == v ) {
+            return supportedVendors[i].name;
+        }
+    }
+
+    return 0;
+}
+
+// Kinds of trace records which are not ioctls
+const uint32_t TRACE_OPEN                = 0xffff0001;
+const uint32_t TRACE_CLOSE               = 0xffff0002;
+const uint32_t TRACE_IDENTITY            = 0xffff0003;
+const uint32_t TRACE_EVENT               = 0xffff0004;
+
+const char TRACE_MAGIC[ 8 ]              = { 'A', 'S', 'D', 'T', 'R', 'A', 'C', 'E' };
+const uint32_t TRACE_VERSION             = 2;
+
+/**
+ * The start of a trace file: what the recorded invocation was asked to do. Trace files are written in the byte order
+ * of the computer which recorded them.
+ */
+struct TraceHeader {
+    char     magic[ 8 ];
+    uint32_t version;
+    uint32_t record_size;
+    int32_t  mode;
+    int32_t  value;
+    int32_t  percent;
+    int32_t  force;
+    int32_t  consistency;
+};
+
+/**
+ * One call to a HID device in a trace file
+ */
+struct TraceRecord {
+    uint64_t time;       // nanoseconds since the recording started, when the call was made
+    uint32_t duration;   // microseconds the call took
+    uint32_t request;    // the ioctl request, or one of the TRACE_ kinds
+    uint32_t display;    // the display, numbered in the order they were opened
+    uint32_t thread;     // the thread which made the call
+    int32_t  result;
+    int32_t  error;      // errno, if the call failed
+    int32_t  value;      // brightness, driver version, flags, application index or product, depending on the request
+    uint32_t detail;     // usage code, report ID or vendor, depending on the request
+};
+
+/**
+ * Where --record writes HID calls to
+ */
+struct Recorder {
+    FILE*              file;
+    long long          start;
+    map<int, uint32_t> displays;
+    uint32_t           next_display;
+    mutex              lock;
+
+    Recorder()
+        : file ( 0 )
+        , start ( 0 )
+        , next_display ( 0 )
+    { }
+};
+
+Recorder recorder;
+
+/**
+ * Returns the current value of the monotonic clock in nanoseconds
+ *
+ * @return Nanoseconds since an arbitrary point in time
+ */
+long long monotonic_ns()
+{
+    struct timespec now;
+
+    clock_gettime ( CLOCK_MONOTONIC, &now );
+
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Starts recording HID calls to a trace file
+ *
+ * @param path        the trace file, which is overwritten
+ * @param mode        what the invocation does: USAGE_MODE_GET, USAGE_MODE_SET, USAGE_MODE_SETREL, or
+ *                    USAGE_MODE_DAEMON for a daemon, whose traces can't be replayed
+ * @param value       the brightness or relative amount
+ * @param percent     whether the value is a percentage
+ * @param force       whether --force was given
+ * @param consistency what brightness changes wait for, one of the CONSISTENCY_ constants
+ *
+ * @return False if the file can't be written, with errno set
+ */
+bool start_recording ( const char* path, int mode, int value, bool percent, bool force, int consistency )
+{
+    TraceHeader header;
+
+    if ( ! ( recorder.file = fopen ( path, "we" ) ) ) {
+        return false;
+    }
+
+    memset ( &header, 0, sizeof ( header ) );
+    memcpy ( header.magic, TRACE_MAGIC, sizeof ( header.magic ) );
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof ( TraceRecord );
+    header.mode = mode;
+    header.value = value;
+    header.percent = percent;
+    header.force = force;
+    header.consistency = consistency;
+
+    recorder.start = monotonic_ns();
+
+    return fwrite ( &header, sizeof ( header ), 1, recorder.file ) == 1;
+}
+
+/**
+ * Finishes the trace file, if recording
+ */
+void stop_recording()
+{
+    lock_guard<mutex> guard ( recorder.lock );
+
+    if ( recorder.file ) {
+        fclose ( recorder.file );
+        recorder.file = 0;
+    }
+}
+
+/**
+ * Writes the calls recorded so far out to the trace file, if recording, so that it can be read while we keep running
+ */
+void flush_recording()
+{
+    lock_guard<mutex> guard ( recorder.lock );
+
+    if ( recorder.file ) {
+        fflush ( recorder.file );
+    }
+}
+
+/**
+ * Appends a call to the trace file, if recording. errno is preserved.
+ *
+ * @param fd      the HID device; for TRACE_OPEN, what opening it returned
+ * @param request the ioctl request, or one of the TRACE_ kinds
+ * @param start   monotonic_ns() when the call was made
+ * @param result  what the call returned; errno is recorded too if this is negative
+ * @param value   see TraceRecord
+ * @param detail  see TraceRecord
+ */
+void record_call ( int fd, uint32_t request, long long start, int result, int value = 0, uint32_t detail = 0 )
+{
+    int error = errno;
+
+    if ( !recorder.file ) {
+        return;
+    }
+
+    TraceRecord record;
+    long long end = monotonic_ns();
+    lock_guard<mutex> guard ( recorder.lock );
+    map<int, uint32_t>::iterator display = recorder.displays.find ( fd );
+
+    if ( !recorder.file ) {
+        return;
+    }
+
+    memset ( &record, 0, sizeof ( record ) );
+    record.time = start - recorder.start;
+    record.duration = ( end - start ) / 1000;
+    record.request = request;
+    record.thread = hash<thread::id>() ( this_thread::get_id() );
+    record.result = result;
+    record.error = result < 0 ? error : 0;
+    record.value = value;
+    record.detail = detail;
+
+    // Descriptors are reused, so a display is only known by its descriptor from its opening to its closing
+    if ( request == TRACE_OPEN || display == recorder.displays.end() ) {
+        record.display = recorder.next_display++;
+
+        if ( fd >= 0 ) {
+            recorder.displays[ fd ] = record.display;
+        }
+    } else {
+        record.display = display->second;
+
+        if ( request == TRACE_CLOSE ) {
+            recorder.displays.erase ( display );
+        }
+    }
+
+    fwrite ( &record, sizeof ( record ), 1, recorder.file );
+    errno = error;
+}
+
+/**
+ * Makes an ioctl() call to a HID device, and records it with --record
+ *
+ * @param fd       the HID device
+ * @param request  the ioctl request
+ * @param argument the ioctl argument
+ *
+ * @return What ioctl() returned, with errno set
+ */
+int hid_ioctl ( int fd, unsigned long request, void* argument = 0 )
+{
+    if ( !recorder.file ) {
+        return ioctl ( fd, request, argument );
+    }
+
+    long long start = monotonic_ns();
+    int result = ioctl ( fd, request, argument );
+    int error = errno;
+    int value = 0;
+    uint32_t detail = 0;
+
+    switch ( request ) {
+    case HIDIOCGVERSION:
+    case HIDIOCSFLAG:
+        value = * ( int* ) argument;
+        break;
+
+    case HIDIOCAPPLICATION:
+        value = ( int ) ( uintptr_t ) argument;
+        break;
+
+    case HIDIOCGDEVINFO:
+        value = ( ( hiddev_devinfo* ) argument )->product & 0xFFFF;
+        detail = ( ( hiddev_devinfo* ) argument )->vendor & 0xFFFF;
+        break;
+
+    case HIDIOCGUSAGE:
+    case HIDIOCSUSAGE:
+    case HIDIOCGUCODE:
+        value = ( ( hiddev_usage_ref* ) argument )->value;
+        detail = ( ( hiddev_usage_ref* ) argument )->usage_code;
+        break;
+
+    case HIDIOCGUSAGES:
+    case HIDIOCSUSAGES:
+        value = ( ( hiddev_usage_ref_multi* ) argument )->values[0];
+        detail = ( ( hiddev_usage_ref_multi* ) argument )->uref.usage_code;
+        break;
+
+    case HIDIOCGREPORT:
+    case HIDIOCSREPORT:
+    case HIDIOCGREPORTINFO:
+        detail = ( ( hiddev_report_info* ) argument )->report_id;
+        break;
+    }
+
+    errno = error;
+    record_call ( fd, request, start, result, value, detail );
+
+    return result;
+}
+
+/**
+ * A trace file loaded for --replay, with the calls of each display in order
+ */
+struct Trace {
+    TraceHeader                   header;
+    vector< vector<TraceRecord> > displays;
+    long long                     elapsed;
+
+    // How the replay went
+    atomic<long>                  replayed;
+    atomic<long>                  skipped;
+    atomic<long>                  missing;
+
+    Trace()
+        : elapsed ( 0 )
+        , replayed ( 0 )
+        , skipped ( 0 )
+        , missing ( 0 )
+    {
+        memset ( &header, 0, sizeof ( header ) );
+    }
+};
+
+Trace replayTrace;
+
+/**
+ * Loads a trace file written by --record
+ *
+ * @param path  the trace file
+ * @param trace where to load it into
+ *
+ * @return False if the file can't be read, with errno set; EINVAL if it is not a trace file
+ */
+bool load_trace ( const char* path, Trace& trace )
+{
+    FILE* file = fopen ( path, "re" );
+    TraceRecord record;
+
+    if ( !file ) {
+        return false;
+    }
+
+    if ( fread ( &trace.header, sizeof ( trace.header ), 1, file ) != 1 ||
+            memcmp ( trace.header.magic, TRACE_MAGIC, sizeof ( TRACE_MAGIC ) ) != 0 ||
+            trace.header.version != TRACE_VERSION || trace.header.record_size != sizeof ( TraceRecord ) ) {
+        fclose ( file );
+        errno = EINVAL;
+
+        return false;
+    }
+
+    while ( fread ( &record, sizeof ( record ), 1, file ) == 1 ) {
+        if ( record.display >= trace.displays.size() ) {
+            trace.displays.resize ( record.display + 1 );
+        }
+
+        trace.displays[ record.display ].push_back ( record );
+        trace.elapsed = max ( trace.elapsed, ( long long ) ( record.time / 1000 + record.duration ) );
+    }
+
+    fclose ( file );
+
+    return true;
+}
+
+/**
+ * Which product a display in a trace is, from its identity or device information
+ *
+ * @return The USB product identifier, or 0 if the trace doesn't tell
+ */
+Product traced_product ( const vector<TraceRecord>& records )
+{
+    for ( size_t i = 0; i < records.size(); ++i ) {
+        if ( ( records[i].request == TRACE_IDENTITY || records[i].request == HIDIOCGDEVINFO ) &&
+                records[i].result >= 0 ) {
+            return records[i].value;
+        }
+    }
+
+    return 0;
 }
 
 /**
@@ -239,9 +815,9 @@ bool is_usb_monitor ( const hiddev_devinfo& device_info, int fd )
      * identifier using ioctl() and compare it to the Monitor Control application ID (0x80) per the
      * HID Usage Tables 1.4.
      */
-    for ( int appl_num = 0; appl_num < device_info.num_applications;
+    for ( unsigned appl_num = 0; appl_num < device_info.num_applications;
             ++appl_num ) {
-        int application = ioctl ( fd, HIDIOCAPPLICATION, appl_num );
+        int application = hid_ioctl ( fd, HIDIOCAPPLICATION, ( void* ) ( uintptr_t ) appl_num );
 
         // See https://usb.org/document-library/hid-usage-tables-14
         if ( ( ( application >> 16 ) & 0xFF ) == 0x80 ) {
@@ -253,64 +829,3274 @@ bool is_usb_monitor ( const hiddev_devinfo& device_info, int fd )
 }
 
 /**
- * Prints the formatted information for the device
+ * Formats the information for the device
  *
- * @param o output stream to print to
  * @param device_info HID device info
+ * @param serial the device's USB serial number, if known
+ *
+ * @return The device information, ending with a newline
  */
-void format_device ( ostream& o, const hiddev_devinfo& device_info )
+string format_device ( const hiddev_devinfo& device_info, const string& serial = "" )
 {
     Vendor  v = device_info.vendor & 0xFFFF;
     Product p = device_info.product & 0xFFFF;
+    const char* vendor = vendor_name ( v );
+    char buffer[ 32 ];
+    string o;
 
-    o << "Vendor=" << showbase << setw ( 6 ) << hex << v;
+    snprintf ( buffer, sizeof ( buffer ), "Vendor=%#6x", v );
+    o += buffer;
 
-    if ( known_vendor ( v ) ) {
-        o << " (" << supportedVendors[ v ] << ")";
+    if ( vendor ) {
+        o = o + " (" + vendor + ")";
     }
 
-    o << ", Product=" << showbase << setw ( 6 ) << hex << p ;
+    snprintf ( buffer, sizeof ( buffer ), ", Product=%#6x", p );
+    o += buffer;
 
     if ( is_supported ( device_info ) ) {
-        o << "[" << description ( v, p ) << "]";
+        o += "[" + description ( v, p ) + "]";
+    }
+
+    if ( !serial.empty() ) {
+        o += ", Serial=" + serial;
     }
 
-    o << endl;
+    return o + "\n";
 }
 
 /**
- * Prints help for the program.
+ * Returns the current value of the monotonic clock in milliseconds
  *
- * @param programName this program name
+ * @return Milliseconds since an arbitrary point in time
  */
-void help ( const char *programName )
+long long monotonic_ms()
 {
-    printf ( "asdcontrol " VERSION "\n" );
+    struct timespec now;
 
-    printf ( "USAGE: %1$s [--silent|-s] [--brief|-b] [--help|-h] [--about|-a] "
-             "[--detect|-d] [--list-all |-l] <hid device(s)> [<brightness>]\n\n"
-             "Parameters:\n"
-             "  --silent,-s\n"
-             "         Suppress non-functional program output.\n"
-             "  --brief,-b\n"
-             "         Don't print the brightness after setting it.\n"
-             "  --detect, -d\n"
-             "         Detect the correct HID device. See the examples.\n"
-             "  --list-all, -l\n"
-             "         List supported devices.\n"
-             "  --help,-h\n"
-             "         Show this help message and quit.\n"
-             "  --about,-a\n"
-             "         Show copyright and license information about the program.\n"
-             "  <hid device(s)>\n"
-             "         Path to the HID device that represents your Apple Studio Display.\n"
-             "         It's usually one of the /dev/usb/hiddevX or /dev/hiddevX device files.\n"
-             "         Use /dev/usb/hiddev* or /dev/hiddev* to go through all HID devices on\n"
-             "         your system.\n"
-             "      Note\n"
-             "         You must have write permissions to this device.\n"
-             "      Note\n"
-             "         It should be safe to run the program on other device than Apple Studio\n"
+    clock_gettime ( CLOCK_MONOTONIC, &now );
+
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/**
+ * What probing a HID device node told us
+ */
+struct Identity {
+    hiddev_devinfo device_info;
+    bool           monitor;
+    string         serial;
+
+    Identity()
+        : monitor ( false )
+    {
+        memset ( &device_info, 0, sizeof ( device_info ) );
+    }
+};
+
+/**
+ * A HID device node's identity, as remembered in the detection cache
+ */
+struct CacheEntry {
+    ino_t          ino;
+    timespec       ctime;
+    Identity       identity;
+    string         path;
+};
+
+typedef map<dev_t, CacheEntry> CacheEntries;
+
+/**
+ * The detection cache.
+ *
+ * Remembers the device information, the USB monitor check and the USB serial number of every HID device node we have
+ * probed, keyed by the node's device number. This doubles as the index used to find displays by serial number. An
+ * entry is only trusted while the node still has the same inode and change time, which is not the case any more once
+ * the device has been unplugged, even if the kernel hands out the same hiddev number again.
+ */
+struct DetectionCache {
+    bool         enabled;
+    bool         loaded;
+    bool         dirty;
+    string       path;
+    CacheEntries entries;
+    mutex        lock;
+
+    DetectionCache()
+        : enabled ( false )
+        , loaded ( false )
+        , dirty ( false )
+    { }
+};
+
+DetectionCache detectionCache;
+
+// Header of the detection cache file; caches in any other format are ignored
+#define DETECTION_CACHE_HEADER "# asdcontrol detection cache 2\n"
+
+// Where sysfs is mounted
+string sysfsRoot = "/sys";
+
+// Which kind of HID device nodes --auto and --hotplug look for
+int deviceBackend = BACKEND_HIDDEV;
+
+// Whether hiddev brightness reads and writes use HIDIOCGUSAGES and HIDIOCSUSAGES; by default only for several usages
+int usageIoctls = USAGE_IOCTLS_AUTO;
+
+/**
+ * Brightness controls discovered from the HID report descriptors, keyed by USB vendor, product and firmware version
+ */
+typedef map<unsigned long long, BrightnessControl> ControlEntries;
+
+/**
+ * The brightness control cache.
+ *
+ * Walking the report descriptor takes a few dozen ioctls per device, and the result only changes with a firmware
+ * update, so it's kept across reboots. Models without a brightness usage are remembered too, with report_id -1.
+ */
+struct ControlCache {
+    bool           dirty;
+    string         path;
+    ControlEntries entries;
+    mutex          lock;
+
+    ControlCache()
+        : dirty ( false )
+    { }
+};
+
+ControlCache controlCache;
+
+// Header of the brightness control cache file; caches in any other format are ignored
+#define CONTROL_CACHE_HEADER "# asdcontrol brightness controls 2\n"
+
+/**
+ * Returns the key of a device model in the brightness control cache
+ *
+ * @param device_info HID device info
+ *
+ * @return Vendor, product and firmware version (bcdDevice) packed together
+ */
+unsigned long long control_key ( const hiddev_devinfo& device_info )
+{
+    return ( ( unsigned long long ) ( device_info.vendor & 0xFFFF ) << 32 ) |
+           ( ( unsigned long long ) ( device_info.product & 0xFFFF ) << 16 ) | ( device_info.version & 0xFFFF );
+}
+
+/**
+ * Returns the path of the brightness control cache file.
+ *
+ * @return $XDG_CACHE_HOME/asdcontrol/controls or ~/.cache/asdcontrol/controls, or an empty string.
+ */
+string control_cache_path()
+{
+    const char* dir = getenv ( "XDG_CACHE_HOME" );
+
+    if ( dir && *dir ) {
+        return string ( dir ) + "/asdcontrol/controls";
+    }
+
+    if ( ( dir = getenv ( "HOME" ) ) && *dir ) {
+        return string ( dir ) + "/.cache/asdcontrol/controls";
+    }
+
+    return "";
+}
+
+/**
+ * Loads the brightness control cache from disk.
+ */
+void load_control_cache()
+{
+    lock_guard<mutex> guard ( controlCache.lock );
+
+    controlCache.path = control_cache_path();
+
+    FILE* file = controlCache.path.empty() ? 0 : fopen ( controlCache.path.c_str(), "re" );
+
+    if ( !file ) {
+        return;
+    }
+
+    char line[ 256 ];
+
+    if ( !fgets ( line, sizeof ( line ), file ) || strcmp ( line, CONTROL_CACHE_HEADER ) != 0 ) {
+        fclose ( file );
+
+        return;
+    }
+
+    while ( fgets ( line, sizeof ( line ), file ) ) {
+        BrightnessControl control;
+        unsigned long long key;
+
+        if ( sscanf ( line, "%llx %d %d %d %x %d %d %d", &key, &control.report_id, &control.field_index,
+                      &control.usage_index, &control.usage_code, &control.minimum, &control.maximum,
+                      &control.usage_count ) == 8 && control.usage_count >= 1 &&
+                control.usage_count <= HID_MAX_MULTI_USAGES ) {
+            controlCache.entries[ key ] = control;
+        }
+    }
+
+    fclose ( file );
+}
+
+/**
+ * Writes the brightness control cache back to disk if anything changed.
+ */
+void save_control_cache()
+{
+    lock_guard<mutex> guard ( controlCache.lock );
+
+    if ( !controlCache.dirty || controlCache.path.empty() ) {
+        return;
+    }
+
+    string dir = controlCache.path.substr ( 0, controlCache.path.rfind ( '/' ) );
+    string temporary = controlCache.path + ".XXXXXX";
+
+    mkdir ( dir.substr ( 0, dir.rfind ( '/' ) ).c_str(), 0700 );
+    mkdir ( dir.c_str(), 0700 );
+
+    int fd = mkstemp ( &temporary[0] );
+
+    if ( fd < 0 ) {
+        return;
+    }
+
+    FILE* file = fdopen ( fd, "w" );
+
+    fputs ( CONTROL_CACHE_HEADER, file );
+
+    for ( ControlEntries::const_iterator it = controlCache.entries.begin(); it != controlCache.entries.end(); ++it ) {
+        const BrightnessControl& control = it->second;
+
+        fprintf ( file, "%012llx %d %d %d %08x %d %d %d\n", it->first, control.report_id, control.field_index,
+                  control.usage_index, control.usage_code, control.minimum, control.maximum, control.usage_count );
+    }
+
+    if ( fclose ( file ) == 0 && rename ( temporary.c_str(), controlCache.path.c_str() ) == 0 ) {
+        controlCache.dirty = false;
+    } else {
+        unlink ( temporary.c_str() );
+    }
+}
+
+/**
+ * Returns the path of the detection cache file.
+ *
+ * Device numbers are only meaningful until the next reboot, so the cache lives in $XDG_RUNTIME_DIR if possible,
+ * otherwise in $XDG_CACHE_HOME or ~/.cache.
+ *
+ * @return The cache file path, or an empty string if there is nowhere to keep it.
+ */
+string detection_cache_path()
+{
+    const char* dir = getenv ( "XDG_RUNTIME_DIR" );
+
+    if ( dir && *dir ) {
+        return string ( dir ) + "/asdcontrol/devices";
+    }
+
+    if ( ( dir = getenv ( "XDG_CACHE_HOME" ) ) && *dir ) {
+        return string ( dir ) + "/asdcontrol/devices";
+    }
+
+    if ( ( dir = getenv ( "HOME" ) ) && *dir ) {
+        return string ( dir ) + "/.cache/asdcontrol/devices";
+    }
+
+    return "";
+}
+
+/**
+ * Enables the detection cache and loads it from disk, together with the brightness control cache.
+ */
+void load_detection_cache()
+{
+    load_control_cache();
+
+    lock_guard<mutex> guard ( detectionCache.lock );
+
+    detectionCache.enabled = true;
+    detectionCache.loaded = true;
+    detectionCache.path = detection_cache_path();
+
+    FILE* file = detectionCache.path.empty() ? 0 : fopen ( detectionCache.path.c_str(), "re" );
+
+    if ( !file ) {
+        return;
+    }
+
+    char line[ PATH_MAX + 512 ];
+
+    if ( !fgets ( line, sizeof ( line ), file ) || strcmp ( line, DETECTION_CACHE_HEADER ) != 0 ) {
+        fclose ( file );
+
+        return;
+    }
+
+    while ( fgets ( line, sizeof ( line ), file ) ) {
+        CacheEntry entry;
+        unsigned long long rdev, ino;
+        long long ctime_sec;
+        long ctime_nsec;
+        int monitor, path_offset = 0;
+        char serial[ 256 ];
+        hiddev_devinfo& info = entry.identity.device_info;
+
+        if ( sscanf ( line, "%llu %llu %lld %ld %u %u %u %u %hd %hd %hu %u %d %255s %n",
+                      &rdev, &ino, &ctime_sec, &ctime_nsec, &info.bustype, &info.busnum, &info.devnum, &info.ifnum,
+                      &info.vendor, &info.product, &info.version, &info.num_applications, &monitor, serial,
+                      &path_offset ) < 14 || !path_offset ) {
+            continue;
+        }
+
+        entry.ino = ino;
+        entry.ctime.tv_sec = ctime_sec;
+        entry.ctime.tv_nsec = ctime_nsec;
+        entry.identity.monitor = monitor != 0;
+        entry.identity.serial = strcmp ( serial, "-" ) ? serial : "";
+        entry.path = line + path_offset;
+
+        while ( !entry.path.empty() && entry.path[ entry.path.size() - 1 ] == '\n' ) {
+            entry.path.erase ( entry.path.size() - 1 );
+        }
+
+        detectionCache.entries[ rdev ] = entry;
+    }
+
+    fclose ( file );
+}
+
+/**
+ * Writes the detection cache back to disk if anything changed.
+ *
+ * The file is replaced atomically, so concurrent invocations never see a partial cache. The brightness control
+ * cache is saved as well.
+ */
+void save_detection_cache()
+{
+    save_control_cache();
+
+    lock_guard<mutex> guard ( detectionCache.lock );
+
+    if ( !detectionCache.enabled || !detectionCache.dirty || detectionCache.path.empty() ) {
+        return;
+    }
+
+    string dir = detectionCache.path.substr ( 0, detectionCache.path.rfind ( '/' ) );
+    string temporary = detectionCache.path + ".XXXXXX";
+
+    mkdir ( dir.substr ( 0, dir.rfind ( '/' ) ).c_str(), 0700 );
+    mkdir ( dir.c_str(), 0700 );
+
+    int fd = mkstemp ( &temporary[0] );
+
+    if ( fd < 0 ) {
+        return;
+    }
+
+    FILE* file = fdopen ( fd, "w" );
+
+    fputs ( DETECTION_CACHE_HEADER, file );
+
+    for ( CacheEntries::const_iterator it = detectionCache.entries.begin(); it != detectionCache.entries.end(); ++it ) {
+        const CacheEntry& entry = it->second;
+        const hiddev_devinfo& info = entry.identity.device_info;
+
+        fprintf ( file, "%llu %llu %lld %ld %u %u %u %u %hd %hd %hu %u %d %s %s\n",
+                  ( unsigned long long ) it->first, ( unsigned long long ) entry.ino, ( long long ) entry.ctime.tv_sec,
+                  ( long ) entry.ctime.tv_nsec, info.bustype, info.busnum, info.devnum, info.ifnum, info.vendor,
+                  info.product, info.version, info.num_applications, entry.identity.monitor ? 1 : 0,
+                  entry.identity.serial.empty() ? "-" : entry.identity.serial.c_str(), entry.path.c_str() );
+    }
+
+    if ( fclose ( file ) == 0 && rename ( temporary.c_str(), detectionCache.path.c_str() ) == 0 ) {
+        detectionCache.dirty = false;
+    } else {
+        unlink ( temporary.c_str() );
+    }
+}
+
+/**
+ * Looks up a HID device node in the detection cache.
+ *
+ * Costs a single stat() of the node. Entries of nodes which have been recreated since they were probed (e.g. the
+ * display was plugged back in) are not returned.
+ *
+ * @param path     HID device path
+ * @param identity receives the cached identity
+ *
+ * @return True on a valid cache hit
+ */
+bool cached_identity ( const char* path, Identity& identity )
+{
+    struct stat st;
+
+    if ( !detectionCache.enabled || stat ( path, &st ) < 0 || !S_ISCHR ( st.st_mode ) ) {
+        return false;
+    }
+
+    lock_guard<mutex> guard ( detectionCache.lock );
+    CacheEntries::const_iterator it = detectionCache.entries.find ( st.st_rdev );
+
+    if ( it == detectionCache.entries.end() || it->second.ino != st.st_ino ||
+            it->second.ctime.tv_sec != st.st_ctim.tv_sec || it->second.ctime.tv_nsec != st.st_ctim.tv_nsec ) {
+        return false;
+    }
+
+    identity = it->second.identity;
+
+    return true;
+}
+
+/**
+ * Reads the USB serial number of an opened HID device.
+ *
+ * The serial number is taken from sysfs if possible. Otherwise the index of the serial number string is read from the
+ * USB device descriptor in /dev/bus/usb, and the string itself is fetched with HIDIOCGSTRING.
+ *
+ * @param fd          the opened HID device
+ * @param device_info its device information
+ *
+ * @return The serial number, or an empty string if the device doesn't have one.
+ */
+string read_serial ( int fd, const hiddev_devinfo& device_info )
+{
+    struct stat st;
+    char path[ PATH_MAX ];
+    char serial[ 256 ] = "";
+
+    // usbfs nodes are the USB device, hiddev nodes belong to its interface, hidraw nodes to a HID device below that
+    static const char* const levels[] = { "", "device/../", "device/../../" };
+
+    for ( int level = 0; level < 3 && fstat ( fd, &st ) == 0 && !serial[0]; ++level ) {
+        snprintf ( path, sizeof ( path ), "%s/dev/char/%u:%u/%sserial", sysfsRoot.c_str(),
+                   major ( st.st_rdev ), minor ( st.st_rdev ), levels[ level ] );
+
+        FILE* file = fopen ( path, "re" );
+
+        if ( file ) {
+            if ( fscanf ( file, "%255s", serial ) != 1 ) {
+                serial[0] = 0;
+            }
+
+            fclose ( file );
+        }
+    }
+
+    if ( !serial[0] ) {
+        unsigned char descriptor[ 18 ];
+        int usb;
+
+        snprintf ( path, sizeof ( path ), "/dev/bus/usb/%03u/%03u", device_info.busnum, device_info.devnum );
+
+        if ( ( usb = open ( path, O_RDONLY | O_CLOEXEC ) ) >= 0 ) {
+            // iSerialNumber is at offset 16 of the device descriptor
+            if ( read ( usb, descriptor, sizeof ( descriptor ) ) == sizeof ( descriptor ) && descriptor[16] ) {
+                hiddev_string_descriptor string_descriptor;
+
+                memset ( &string_descriptor, 0, sizeof ( string_descriptor ) );
+                string_descriptor.index = descriptor[16];
+
+                if ( hid_ioctl ( fd, HIDIOCGSTRING, &string_descriptor ) > 0 ) {
+                    sscanf ( string_descriptor.value, "%255s", serial );
+                }
+            }
+
+            close ( usb );
+        }
+    }
+
+    return serial;
+}
+
+int DeviceBackend::open ( const char* path, int open_mode )
+{
+    long long start = monotonic_ns();
+    int fd = ::open ( path, open_mode | O_CLOEXEC );
+
+    record_call ( fd, TRACE_OPEN, start, fd );
+
+    return fd;
+}
+
+void DeviceBackend::close ( int fd )
+{
+    long long start = monotonic_ns();
+    int result = ::close ( fd );
+
+    record_call ( fd, TRACE_CLOSE, start, result );
+}
+
+string DeviceBackend::serial ( int fd, const hiddev_devinfo& device_info )
+{
+    return read_serial ( fd, device_info );
+}
+
+/**
+ * Stores the result of probing a HID device node in the detection cache.
+ *
+ * The device's serial number is read first if the identity doesn't have it yet.
+ *
+ * @param fd       the opened node
+ * @param path     HID device path
+ * @param backend  the backend the node was opened with
+ * @param identity the device's identity
+ */
+void remember_identity ( int fd, const char* path, DeviceBackend* backend, Identity& identity )
+{
+    struct stat st;
+
+    if ( identity.serial.empty() && is_supported ( identity.device_info ) ) {
+        identity.serial = backend->serial ( fd, identity.device_info );
+    }
+
+    if ( !detectionCache.enabled || fstat ( fd, &st ) < 0 || !S_ISCHR ( st.st_mode ) ) {
+        return;
+    }
+
+    CacheEntry entry;
+
+    entry.ino = st.st_ino;
+    entry.ctime = st.st_ctim;
+    entry.identity = identity;
+    entry.path = path;
+
+    lock_guard<mutex> guard ( detectionCache.lock );
+
+    detectionCache.entries[ st.st_rdev ] = entry;
+    detectionCache.dirty = true;
+}
+
+/**
+ * Reads a hexadecimal number from a sysfs attribute file, e.g. idVendor
+ *
+ * @param path  attribute file
+ * @param value receives the number
+ *
+ * @return False if the file can't be read or doesn't contain a number.
+ */
+bool read_sysfs_hex ( const string& path, unsigned& value )
+{
+    FILE* file = fopen ( path.c_str(), "re" );
+
+    if ( !file ) {
+        return false;
+    }
+
+    bool ok = fscanf ( file, "%x", &value ) == 1;
+
+    fclose ( file );
+
+    return ok;
+}
+
+/**
+ * Returns the device node for a hiddev device name such as hiddev0.
+ *
+ * Depending on the distribution the node is /dev/usb/hiddevN or /dev/hiddevN.
+ *
+ * @param name the kernel's device name
+ *
+ * @return The device node path
+ */
+string hiddev_node ( const string& name )
+{
+    string node = "/dev/usb/" + name;
+
+    if ( access ( node.c_str(), F_OK ) != 0 && access ( ( "/dev/" + name ).c_str(), F_OK ) == 0 ) {
+        node = "/dev/" + name;
+    }
+
+    return node;
+}
+
+/**
+ * Finds the usbfs nodes of supported displays without opening any device.
+ *
+ * The USB vendor and product identifiers of every USB device are read from sysfs
+ * (<sysfs root>/bus/usb/devices/N-N/idVendor and idProduct) and compared with the supported devices database. The node
+ * is /dev/bus/usb/BBB/DDD, from the device's busnum and devnum.
+ *
+ * @param sysfs_root where sysfs is mounted, normally /sys
+ *
+ * @return The device nodes of all supported displays, in bus and device number order
+ */
+vector<string> enumerate_usb_displays ( const string& sysfs_root )
+{
+    vector<string> nodes;
+    string devices_dir = sysfs_root + "/bus/usb/devices";
+    DIR* dir = opendir ( devices_dir.c_str() );
+
+    if ( !dir ) {
+        return nodes;
+    }
+
+    while ( dirent* entry = readdir ( dir ) ) {
+        string device = devices_dir + "/" + entry->d_name + "/";
+        unsigned vendor, product, bus = 0, number = 0;
+        char node[ 64 ];
+
+        // Interfaces (N-N:C.I) have no identifiers of their own
+        if ( entry->d_name[0] == '.' || strchr ( entry->d_name, ':' ) ||
+                !read_sysfs_hex ( device + "idVendor", vendor ) || !read_sysfs_hex ( device + "idProduct", product ) ||
+                !find_device ( vendor, product ) ) {
+            continue;
+        }
+
+        FILE* file = fopen ( ( device + "busnum" ).c_str(), "re" );
+
+        if ( file ) {
+            if ( fscanf ( file, "%u", &bus ) != 1 ) {
+                bus = 0;
+            }
+
+            fclose ( file );
+        }
+
+        if ( ( file = fopen ( ( device + "devnum" ).c_str(), "re" ) ) ) {
+            if ( fscanf ( file, "%u", &number ) != 1 ) {
+                number = 0;
+            }
+
+            fclose ( file );
+        }
+
+        if ( bus && number ) {
+            snprintf ( node, sizeof ( node ), "/dev/bus/usb/%03u/%03u", bus, number );
+            nodes.push_back ( node );
+        }
+    }
+
+    closedir ( dir );
+    sort ( nodes.begin(), nodes.end() );
+
+    return nodes;
+}
+
+/**
+ * Finds the hiddev (or, with the hidraw backend, hidraw) nodes of supported displays without opening any device.
+ *
+ * The USB vendor and product identifiers of every hiddev device are read from sysfs
+ * (<sysfs root>/class/usbmisc/hiddevN/device/../idVendor and idProduct, or
+ * <sysfs root>/class/hidraw/hidrawN/device/../../idVendor and idProduct) and compared with the supported devices
+ * database. Only the nodes of supported devices are returned, in device number order. Nodes known to the detection
+ * cache skip the sysfs lookup. With the usbfs backend this is enumerate_usb_displays().
+ *
+ * @param sysfs_root where sysfs is mounted, normally /sys
+ *
+ * @return The device nodes of all supported displays
+ */
+vector<string> enumerate_displays ( const string& sysfs_root )
+{
+    if ( deviceBackend == BACKEND_USBFS ) {
+        return enumerate_usb_displays ( sysfs_root );
+    }
+
+    vector< pair<int, string> > found;
+    bool hidraw = deviceBackend == BACKEND_HIDRAW;
+    string prefix = hidraw ? "hidraw" : "hiddev";
+    string class_dir = sysfs_root + ( hidraw ? "/class/hidraw" : "/class/usbmisc" );
+    DIR* dir = opendir ( class_dir.c_str() );
+
+    if ( !dir ) {
+        return vector<string>();
+    }
+
+    while ( dirent* entry = readdir ( dir ) ) {
+        string name = entry->d_name;
+
+        if ( name.compare ( 0, 6, prefix ) != 0 ) {
+            continue;
+        }
+
+        string node = hidraw ? "/dev/" + name : hiddev_node ( name );
+        Identity identity;
+
+        // device is the HID interface (for hidraw, the HID device on it); its parent is the USB device
+        string usb_device = class_dir + "/" + name + ( hidraw ? "/device/../../" : "/device/../" );
+        unsigned vendor, product;
+
+        if ( cached_identity ( node.c_str(), identity ) ) {
+            vendor = identity.device_info.vendor & 0xFFFF;
+            product = identity.device_info.product & 0xFFFF;
+        } else if ( !read_sysfs_hex ( usb_device + "idVendor", vendor ) ||
+                    !read_sysfs_hex ( usb_device + "idProduct", product ) ) {
+            continue;
+        }
+
+        if ( !find_device ( vendor, product ) ) {
+            continue;
+        }
+
+        found.push_back ( make_pair ( atoi ( name.c_str() + 6 ), node ) );
+    }
+
+    closedir ( dir );
+    sort ( found.begin(), found.end() );
+
+    vector<string> nodes;
+
+    for ( size_t i = 0; i < found.size(); ++i ) {
+        nodes.push_back ( found[i].second );
+    }
+
+    return nodes;
+}
+
+/**
+ * Finds the brightness control of a HID device by walking its feature reports.
+ *
+ * Every usage of every field of every feature report is looked up with HIDIOCGREPORTINFO, HIDIOCGFIELDINFO and
+ * HIDIOCGUCODE until the VESA Virtual Controls brightness usage turns up. Its report ID, position in the report and
+ * logical range are what we need to read and write the brightness. Brightness usages right after it in the same field
+ * belong to the same control.
+ *
+ * @param fd      the opened HID device
+ * @param control receives the brightness control
+ *
+ * @return False if the device has no brightness usage.
+ */
+bool discover_brightness ( int fd, BrightnessControl& control )
+{
+    struct hiddev_report_info rep_info;
+
+    memset ( &rep_info, 0, sizeof ( rep_info ) );
+    rep_info.report_type = HID_REPORT_TYPE_FEATURE;
+    rep_info.report_id = HID_REPORT_ID_FIRST;
+
+    while ( hid_ioctl ( fd, HIDIOCGREPORTINFO, &rep_info ) >= 0 ) {
+        for ( unsigned field = 0; field < rep_info.num_fields; ++field ) {
+            struct hiddev_field_info field_info;
+
+            memset ( &field_info, 0, sizeof ( field_info ) );
+            field_info.report_type = rep_info.report_type;
+            field_info.report_id = rep_info.report_id;
+            field_info.field_index = field;
+
+            if ( hid_ioctl ( fd, HIDIOCGFIELDINFO, &field_info ) < 0 ) {
+                continue;
+            }
+
+            for ( unsigned usage = 0; usage < field_info.maxusage; ++usage ) {
+                struct hiddev_usage_ref usage_ref;
+
+                memset ( &usage_ref, 0, sizeof ( usage_ref ) );
+                usage_ref.report_type = rep_info.report_type;
+                usage_ref.report_id = rep_info.report_id;
+                usage_ref.field_index = field;
+                usage_ref.usage_index = usage;
+
+                if ( hid_ioctl ( fd, HIDIOCGUCODE, &usage_ref ) < 0 || usage_ref.usage_code != BRIGHTNESS_USAGE ) {
+                    continue;
+                }
+
+                control.report_id = rep_info.report_id;
+                control.field_index = field;
+                control.usage_index = usage;
+                control.usage_code = usage_ref.usage_code;
+                control.minimum = field_info.logical_minimum;
+                control.maximum = field_info.logical_maximum;
+                control.usage_count = 1;
+
+                while ( usage + control.usage_count < field_info.maxusage &&
+                        control.usage_count < HID_MAX_MULTI_USAGES ) {
+                    usage_ref.usage_index = usage + control.usage_count;
+
+                    if ( hid_ioctl ( fd, HIDIOCGUCODE, &usage_ref ) < 0 || usage_ref.usage_code != BRIGHTNESS_USAGE ) {
+                        break;
+                    }
+
+                    ++control.usage_count;
+                }
+
+                return true;
+            }
+        }
+
+        rep_info.report_id |= HID_REPORT_ID_NEXT;
+    }
+
+    return false;
+}
+
+/**
+ * Makes a display use a brightness control, or the range in the supported devices database if the control is unusable
+ *
+ * @param display the opened display
+ * @param control the control from discovery or the control cache; report_id is -1 if discovery failed
+ */
+void use_brightness_control ( Display& display, const BrightnessControl& control )
+{
+    if ( control.report_id >= 0 && control.maximum > control.minimum ) {
+        display.control = control;
+    } else if ( display.device ) {
+        display.control.minimum = display.device->brightness_min;
+        display.control.maximum = display.device->brightness_max;
+    }
+}
+
+/**
+ * Sets up the brightness control of a display from the control cache
+ *
+ * @param display the opened display
+ *
+ * @return False if the control cache doesn't know this model
+ */
+bool cached_brightness_control ( Display& display )
+{
+    BrightnessControl control;
+
+    {
+        lock_guard<mutex> guard ( controlCache.lock );
+        ControlEntries::const_iterator it = controlCache.entries.find ( control_key ( display.device_info ) );
+
+        if ( it == controlCache.entries.end() ) {
+            return false;
+        }
+
+        control = it->second;
+    }
+
+    use_brightness_control ( display, control );
+
+    return true;
+}
+
+/**
+ * Sets up the brightness control of an opened display.
+ *
+ * The control is taken from the brightness control cache, or discovered from the report descriptor the first time a
+ * model and firmware version is seen. Devices without a brightness usage fall back to the supported devices
+ * database.
+ *
+ * @param display the opened display
+ */
+void setup_brightness_control ( Display& display )
+{
+    BrightnessControl control;
+
+    if ( cached_brightness_control ( display ) ) {
+        return;
+    }
+
+    if ( !discover_brightness ( display.fd, control ) ) {
+        control.report_id = -1;
+    }
+
+    if ( detectionCache.enabled ) {
+        lock_guard<mutex> guard ( controlCache.lock );
+
+        controlCache.entries[ control_key ( display.device_info ) ] = control;
+        controlCache.dirty = true;
+    }
+
+    use_brightness_control ( display, control );
+}
+
+/**
+ * Global items of a HID report descriptor, as kept on the Push/Pop stack
+ */
+struct ReportGlobals {
+    unsigned usage_page;
+    unsigned report_id;
+    unsigned report_size;
+    unsigned report_count;
+    int      logical_minimum;
+    unsigned logical_maximum;
+    int      signed_maximum;
+
+    ReportGlobals()
+    {
+        memset ( this, 0, sizeof ( *this ) );
+    }
+};
+
+/**
+ * Parses a raw HID report descriptor, as read from a hidraw node.
+ *
+ * This is what the hiddev driver does for us in the kernel: it tells whether the device implements the Monitor Control
+ * application (0x80), and where the VESA brightness usage lives in the feature reports.
+ *
+ * @param data       the report descriptor
+ * @param size       its length in bytes
+ * @param monitor    receives whether the device is a USB monitor
+ * @param control    receives the brightness control, including its bit position in the feature report
+ *
+ * @return False if there is no brightness usage in the feature reports.
+ */
+bool parse_report_descriptor ( const unsigned char* data, size_t size, bool& monitor, BrightnessControl& control )
+{
+    ReportGlobals globals;
+    vector<ReportGlobals> stack;
+    vector<unsigned> usages;
+    unsigned usage_minimum = 0, usage_maximum = 0;
+    map<unsigned, unsigned> feature_bits;
+    bool found = false;
+
+    monitor = false;
+
+    for ( size_t i = 0; i < size; ) {
+        unsigned char prefix = data[ i++ ];
+
+        // Long items are not used by any HID device in practice
+        if ( prefix == 0xFE ) {
+            i += ( i < size ? data[i] : 0 ) + 2;
+            continue;
+        }
+
+        size_t length = ( prefix & 3 ) == 3 ? 4 : prefix & 3;
+        unsigned value = 0;
+
+        if ( i + length > size ) {
+            break;
+        }
+
+        for ( size_t byte = 0; byte < length; ++byte ) {
+            value |= data[ i + byte ] << ( 8 * byte );
+        }
+
+        i += length;
+
+        int signed_value = ( length && length < 4 && ( value >> ( 8 * length - 1 ) ) & 1 )
+                           ? ( int ) ( value | ( ~0u << ( 8 * length ) ) ) : ( int ) value;
+        int type = ( prefix >> 2 ) & 3;
+        int tag = prefix >> 4;
+
+        if ( type == 0 ) {
+            unsigned first = usages.empty() ? usage_minimum : usages[0];
+
+            // Application collection
+            if ( tag == 0xA && value == 1 && ( first >> 16 ) == 0x80 ) {
+                monitor = true;
+            }
+
+            // Feature item, other than a constant (padding) one
+            if ( tag == 0xB && ! ( value & 1 ) ) {
+                bool found_here = false;
+
+                for ( unsigned n = 0; n < globals.report_count && ( !found || found_here ); ++n ) {
+                    unsigned usage = n < usages.size() ? usages[n]
+                                     : ( usage_minimum + n <= usage_maximum ) ? usage_minimum + n
+                                     : usages.empty() ? 0 : usages.back();
+
+                    // Brightness usages right after the first one belong to the same control
+                    if ( found_here ) {
+                        if ( usage != BRIGHTNESS_USAGE || control.usage_count == HID_MAX_MULTI_USAGES ) {
+                            break;
+                        }
+
+                        ++control.usage_count;
+                        continue;
+                    }
+
+                    if ( usage != BRIGHTNESS_USAGE ) {
+                        continue;
+                    }
+
+                    control.report_id = globals.report_id;
+                    control.field_index = 0;
+                    control.usage_index = n;
+                    control.usage_code = usage;
+                    control.minimum = globals.logical_minimum;
+                    control.maximum = globals.logical_minimum < 0 ? globals.signed_maximum
+                                      : ( int ) globals.logical_maximum;
+                    control.bit_offset = feature_bits[ globals.report_id ] + n * globals.report_size;
+                    control.bit_size = globals.report_size;
+                    control.usage_count = 1;
+                    found = found_here = true;
+                }
+            }
+
+            if ( tag == 0xB ) {
+                feature_bits[ globals.report_id ] += globals.report_size * globals.report_count;
+            }
+
+            // Local items only apply to the next main item
+            usages.clear();
+            usage_minimum = usage_maximum = 0;
+        } else if ( type == 1 ) {
+            switch ( tag ) {
+            case 0x0:
+                globals.usage_page = value;
+                break;
+            case 0x1:
+                globals.logical_minimum = signed_value;
+                break;
+            case 0x2:
+                globals.logical_maximum = value;
+                globals.signed_maximum = signed_value;
+                break;
+            case 0x7:
+                globals.report_size = value;
+                break;
+            case 0x8:
+                globals.report_id = value;
+                break;
+            case 0x9:
+                globals.report_count = value;
+                break;
+            case 0xA:
+                stack.push_back ( globals );
+                break;
+            case 0xB:
+                if ( !stack.empty() ) {
+                    globals = stack.back();
+                    stack.pop_back();
+                }
+                break;
+            }
+        } else if ( type == 2 ) {
+            // Usages without a page of their own are on the current usage page
+            unsigned usage = length == 4 ? value : ( globals.usage_page << 16 ) | value;
+
+            if ( tag == 0x0 ) {
+                usages.push_back ( usage );
+            } else if ( tag == 0x1 ) {
+                usage_minimum = usage;
+            } else if ( tag == 0x2 ) {
+                usage_maximum = usage;
+            }
+        }
+    }
+
+    if ( found ) {
+        unsigned bits = feature_bits[ control.report_id ];
+
+        // The report number comes first, then the report itself
+        control.report_length = 1 + ( bits + 7 ) / 8;
+        control.exclusive = bits == ( unsigned ) ( control.bit_size * control.usage_count );
+    }
+
+    return found && control.bit_size > 0 && control.bit_size <= 32;
+}
+
+/**
+ * Reads and parses the report descriptor of an opened hidraw node.
+ *
+ * @param fd      the opened hidraw node
+ * @param monitor receives whether the device is a USB monitor
+ * @param control receives the brightness control
+ *
+ * @return False if the descriptor can't be read or has no brightness usage.
+ */
+bool hidraw_layout ( int fd, bool& monitor, BrightnessControl& control )
+{
+    hidraw_report_descriptor descriptor;
+
+    monitor = false;
+
+    if ( hid_ioctl ( fd, HIDIOCGRDESCSIZE, &descriptor.size ) < 0 || hid_ioctl ( fd, HIDIOCGRDESC, &descriptor ) < 0 ) {
+        return false;
+    }
+
+    return parse_report_descriptor ( descriptor.value, descriptor.size, monitor, control );
+}
+
+/**
+ * The system calls the usbfs backend is built on.
+ *
+ * The kernel implementation passes them straight through. FakeUsbfs stands in for it so that the request and response
+ * encoding can be exercised, and benchmarked, without a display.
+ */
+struct UsbfsTransport {
+    virtual ~UsbfsTransport() { }
+
+    virtual int open ( const char* path ) = 0;
+
+    /**
+     * Reads the raw device and configuration descriptors, as returned by read() on a usbfs node
+     */
+    virtual ssize_t descriptors ( int fd, unsigned char* buffer, size_t size ) = 0;
+
+    virtual int ioctl ( int fd, unsigned long request, void* argument ) = 0;
+
+    virtual void close ( int fd ) = 0;
+};
+
+/**
+ * usbfs as provided by the kernel
+ */
+struct KernelUsbfs : UsbfsTransport {
+    int open ( const char* path )
+    {
+        // usbfs refuses almost every ioctl on nodes which are not open for writing
+        return ::open ( path, O_RDWR | O_CLOEXEC );
+    }
+
+    ssize_t descriptors ( int fd, unsigned char* buffer, size_t size )
+    {
+        return pread ( fd, buffer, size, 0 );
+    }
+
+    int ioctl ( int fd, unsigned long request, void* argument )
+    {
+        return ::ioctl ( fd, request, argument );
+    }
+
+    void close ( int fd )
+    {
+        ::close ( fd );
+    }
+};
+
+// HID report descriptor of the fake display: the brightness alone in feature report 1, like the Studio Display
+const unsigned char fakeReportDescriptor[] = {
+    0x05, 0x80,                     // Usage Page (Monitor)
+    0x09, 0x01,                     // Usage (Monitor Control)
+    0xa1, 0x01,                     // Collection (Application)
+    0x85, 0x01,                     //   Report ID (1)
+    0x05, 0x82,                     //   Usage Page (VESA Virtual Controls)
+    0x09, 0x10,                     //   Usage (Brightness)
+    0x16, 0x90, 0x01,               //   Logical Minimum (400)
+    0x27, 0x60, 0xea, 0x00, 0x00,   //   Logical Maximum (60000)
+    0x75, 0x20,                     //   Report Size (32)
+    0x95, 0x01,                     //   Report Count (1)
+    0xb1, 0x02,                     //   Feature (Data, Variable, Absolute)
+    0xc0                            // End Collection
+};
+
+/**
+ * An in-process stand-in for the usbfs node of an Apple Studio Display.
+ *
+ * It answers the standard GET_DESCRIPTOR request for the HID report descriptor, and the HID class GET_REPORT and
+ * SET_REPORT requests for the brightness feature report, checking their encoding the way the display would. The
+ * brightness is kept in a state file if one is given, so that separate invocations see each other's changes.
+ *
+ * Its file descriptors are eventfds: real descriptors which are not character devices, so they never end up in the
+ * detection cache.
+ */
+struct FakeUsbfs : UsbfsTransport {
+    string state_path;
+    int    brightness;
+
+    FakeUsbfs()
+        : brightness ( 30200 )
+    { }
+
+    // Picks up the changes of other invocations
+    void load()
+    {
+        FILE* file = state_path.empty() ? 0 : fopen ( state_path.c_str(), "re" );
+
+        if ( file ) {
+            if ( fscanf ( file, "%d", &brightness ) != 1 ) {
+                brightness = 30200;
+            }
+
+            fclose ( file );
+        }
+    }
+
+    int open ( const char* )
+    {
+        load();
+
+        return eventfd ( 0, EFD_CLOEXEC );
+    }
+
+    ssize_t descriptors ( int, unsigned char* buffer, size_t size )
+    {
+        static const unsigned char device[] = {
+            // Device: USB 2.0, vendor 05ac, product 1114, release 1.00
+            0x12, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x40, 0xac, 0x05, 0x14, 0x11, 0x00, 0x01, 0x01, 0x02, 0x03, 0x01,
+            // Configuration 1
+            0x09, 0x02, 0x22, 0x00, 0x01, 0x01, 0x00, 0xc0, 0x00,
+            // Interface 7: HID
+            0x09, 0x04, 0x07, 0x00, 0x01, 0x03, 0x00, 0x00, 0x00,
+            // HID descriptor: one report descriptor
+            0x09, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, sizeof ( fakeReportDescriptor ), 0x00,
+            // Interrupt IN endpoint
+            0x07, 0x05, 0x87, 0x03, 0x40, 0x00, 0x01
+        };
+
+        size = min ( size, sizeof ( device ) );
+        memcpy ( buffer, device, size );
+
+        return size;
+    }
+
+    int ioctl ( int, unsigned long request, void* argument )
+    {
+        if ( request == USBDEVFS_CLAIMINTERFACE || request == USBDEVFS_RELEASEINTERFACE ) {
+            return *( unsigned* ) argument == INTERFACE ? 0 : fail ( ENOENT );
+        }
+
+        if ( request != USBDEVFS_CONTROL ) {
+            return fail ( ENOTTY );
+        }
+
+        usbdevfs_ctrltransfer& transfer = *( usbdevfs_ctrltransfer* ) argument;
+        unsigned char* data = ( unsigned char* ) transfer.data;
+
+        if ( transfer.wIndex != INTERFACE ) {
+            return fail ( EPIPE );
+        }
+
+        // GET_DESCRIPTOR, HID report descriptor
+        if ( transfer.bRequestType == 0x81 && transfer.bRequest == 0x06 && transfer.wValue == 0x2200 ) {
+            size_t length = min ( ( size_t ) transfer.wLength, sizeof ( fakeReportDescriptor ) );
+
+            memcpy ( data, fakeReportDescriptor, length );
+
+            return length;
+        }
+
+        // Only the feature report with the brightness (report ID 1) exists
+        if ( transfer.wValue != 0x0301 || transfer.wLength != 5 ) {
+            return fail ( EPIPE );
+        }
+
+        // GET_REPORT
+        if ( transfer.bRequestType == 0xa1 && transfer.bRequest == 0x01 ) {
+            load();
+            data[0] = 1;
+
+            for ( int byte = 0; byte < 4; ++byte ) {
+                data[ 1 + byte ] = ( unsigned ) brightness >> ( 8 * byte );
+            }
+
+            return 5;
+        }
+
+        // SET_REPORT
+        if ( transfer.bRequestType == 0x21 && transfer.bRequest == 0x09 && data[0] == 1 ) {
+            brightness = data[1] | data[2] << 8 | data[3] << 16 | data[4] << 24;
+
+            FILE* file = state_path.empty() ? 0 : fopen ( state_path.c_str(), "we" );
+
+            if ( file ) {
+                fprintf ( file, "%d\n", brightness );
+                fclose ( file );
+            }
+
+            return 5;
+        }
+
+        return fail ( EPIPE );
+    }
+
+    void close ( int fd )
+    {
+        ::close ( fd );
+    }
+
+    static const unsigned INTERFACE = 7;
+
+    static int fail ( int error )
+    {
+        errno = error;
+
+        return -1;
+    }
+};
+
+
+KernelUsbfs kernelUsbfs;
+FakeUsbfs fakeUsbfs;
+
+// The usbfs implementation in use; --fake-usbfs replaces the kernel's
+UsbfsTransport* usbfs = &kernelUsbfs;
+
+/**
+ * Sends a control request to an opened usbfs node, and records it with --record.
+ *
+ * @param fd           the opened node
+ * @param request_type bmRequestType
+ * @param request      bRequest
+ * @param value        wValue
+ * @param index        wIndex
+ * @param data         the data to send, or the buffer to receive into
+ * @param length       wLength
+ *
+ * @return The number of bytes transferred, or -1 with errno set.
+ */
+int usbfs_control ( int fd, unsigned char request_type, unsigned char request, unsigned short value,
+                    unsigned short index, void* data, unsigned short length )
+{
+    usbdevfs_ctrltransfer transfer;
+
+    transfer.bRequestType = request_type;
+    transfer.bRequest = request;
+    transfer.wValue = value;
+    transfer.wIndex = index;
+    transfer.wLength = length;
+    transfer.timeout = 1000;
+    transfer.data = data;
+
+    long long start = monotonic_ns();
+    int result = usbfs->ioctl ( fd, USBDEVFS_CONTROL, &transfer );
+
+    record_call ( fd, USBDEVFS_CONTROL, start, result, value, request );
+
+    return result;
+}
+
+/**
+ * Reads the device information of an opened usbfs node from its device descriptor
+ *
+ * @param fd          the opened node
+ * @param path        its path, /dev/bus/usb/BBB/DDD
+ * @param device_info receives the device information
+ */
+void usbfs_device_info ( int fd, const char* path, hiddev_devinfo& device_info )
+{
+    unsigned char descriptor[ 18 ];
+
+    memset ( &device_info, 0, sizeof ( device_info ) );
+
+    if ( usbfs->descriptors ( fd, descriptor, sizeof ( descriptor ) ) == sizeof ( descriptor ) ) {
+        device_info.bustype = BUS_USB;
+        device_info.vendor = descriptor[8] | descriptor[9] << 8;
+        device_info.product = descriptor[10] | descriptor[11] << 8;
+        device_info.version = descriptor[12] | descriptor[13] << 8;
+    }
+
+    const char* bus = strstr ( path, "/bus/usb/" );
+
+    if ( bus ) {
+        sscanf ( bus, "/bus/usb/%u/%u", &device_info.busnum, &device_info.devnum );
+    }
+}
+
+/**
+ * Finds the HID interface of an opened usbfs node which controls the brightness, and claims it.
+ *
+ * Every HID interface of the active configuration is claimed in turn and its report descriptor fetched with a
+ * GET_DESCRIPTOR request, until one turns out to be a USB monitor with a brightness usage. That interface stays
+ * claimed; the others are released again. Interfaces bound to the kernel's HID driver can't be claimed.
+ *
+ * @param fd      the opened node
+ * @param monitor receives whether a USB monitor interface was found
+ * @param control receives the brightness control, including the interface number
+ *
+ * @return False if no interface with a brightness control could be claimed, with errno set.
+ */
+bool usbfs_layout ( int fd, bool& monitor, BrightnessControl& control )
+{
+    unsigned char descriptors[ 4096 ];
+    ssize_t size = usbfs->descriptors ( fd, descriptors, sizeof ( descriptors ) );
+    int interface = -1, error = ENOENT;
+
+    monitor = false;
+
+    for ( ssize_t offset = 0; offset + 2 <= size && descriptors[ offset ] >= 2; offset += descriptors[ offset ] ) {
+        const unsigned char* descriptor = descriptors + offset;
+
+        // Only the first configuration is active
+        if ( descriptor[1] == 0x02 && offset > 18 ) {
+            break;
+        }
+
+        // Interface descriptor: alternate setting 0 of a HID interface
+        if ( descriptor[1] == 0x04 && offset + 9 <= size ) {
+            interface = ( descriptor[3] == 0 && descriptor[5] == 0x03 ) ? descriptor[2] : -1;
+            continue;
+        }
+
+        // HID descriptor, following the interface descriptor
+        if ( descriptor[1] != 0x21 || interface < 0 || offset + 9 > size ) {
+            continue;
+        }
+
+        unsigned length = 0;
+
+        for ( int i = 0; i < descriptor[5] && 9 + 3 * i <= descriptor[0]; ++i ) {
+            if ( descriptor[ 6 + 3 * i ] == 0x22 ) {
+                length = descriptor[ 7 + 3 * i ] | descriptor[ 8 + 3 * i ] << 8;
+            }
+        }
+
+        unsigned number = interface;
+        vector<unsigned char> report ( length );
+
+        interface = -1;
+
+        if ( !length || usbfs->ioctl ( fd, USBDEVFS_CLAIMINTERFACE, &number ) < 0 ) {
+            error = length ? errno : error;
+            continue;
+        }
+
+        int received = usbfs_control ( fd, 0x81, 0x06, 0x2200, number, &report[0], length );
+        bool is_monitor;
+
+        if ( received > 0 && parse_report_descriptor ( &report[0], received, is_monitor, control ) && is_monitor ) {
+            control.interface = number;
+            monitor = true;
+
+            return true;
+        }
+
+        error = received < 0 ? errno : ENOENT;
+        monitor = monitor || ( received > 0 && is_monitor );
+        usbfs->ioctl ( fd, USBDEVFS_RELEASEINTERFACE, &number );
+    }
+
+    errno = error;
+
+    return false;
+}
+
+/**
+ * Reads a feature report field from a raw report buffer
+ *
+ * @param report  the report, starting with the report number
+ * @param control the brightness control describing the field
+ *
+ * @return The field's value
+ */
+int report_field ( const unsigned char* report, const BrightnessControl& control )
+{
+    unsigned value = 0;
+
+    for ( int bit = 0; bit < control.bit_size; ++bit ) {
+        int position = control.bit_offset + bit;
+
+        value |= ( ( report[ 1 + position / 8 ] >> ( position % 8 ) ) & 1u ) << bit;
+    }
+
+    // Sign extend fields with a negative logical minimum
+    if ( control.minimum < 0 && control.bit_size < 32 && ( value >> ( control.bit_size - 1 ) ) & 1 ) {
+        value |= ~0u << control.bit_size;
+    }
+
+    return ( int ) value;
+}
+
+/**
+ * Writes a feature report field into a raw report buffer, into every usage of the brightness control
+ *
+ * @param report  the report, starting with the report number
+ * @param control the brightness control describing the field
+ * @param value   the field's new value
+ */
+void set_report_field ( unsigned char* report, const BrightnessControl& control, int value )
+{
+    for ( int bit = 0; bit < control.bit_size * control.usage_count; ++bit ) {
+        int position = control.bit_offset + bit;
+        unsigned char mask = 1 << ( position % 8 );
+
+        if ( ( ( unsigned ) value >> ( bit % control.bit_size ) ) & 1 ) {
+            report[ 1 + position / 8 ] |= mask;
+        } else {
+            report[ 1 + position / 8 ] &= ~mask;
+        }
+    }
+}
+
+/**
+ * Reads the brightness feature report of an opened usbfs node with a HID class GET_REPORT request
+ *
+ * @param fd      the opened node, with the HID interface claimed
+ * @param control the brightness control
+ * @param report  receives the report, starting with the report number like for hidraw
+ *
+ * @return The number of bytes received, or -1 with errno set.
+ */
+int usbfs_get_report ( int fd, const BrightnessControl& control, unsigned char* report )
+{
+    // Only numbered reports carry their number on the wire
+    unsigned char* data = control.report_id ? report : report + 1;
+
+    report[0] = control.report_id;
+
+    return usbfs_control ( fd, 0xa1, 0x01, 0x0300 | control.report_id, control.interface, data,
+                           control.report_length - ( control.report_id ? 0 : 1 ) );
+}
+
+/**
+ * Sends the brightness feature report to an opened usbfs node with a HID class SET_REPORT request
+ *
+ * @param fd      the opened node, with the HID interface claimed
+ * @param control the brightness control
+ * @param report  the report, starting with the report number like for hidraw
+ *
+ * @return The number of bytes sent, or -1 with errno set.
+ */
+int usbfs_set_report ( int fd, const BrightnessControl& control, unsigned char* report )
+{
+    unsigned char* data = control.report_id ? report : report + 1;
+
+    report[0] = control.report_id;
+
+    return usbfs_control ( fd, 0x21, 0x09, 0x0300 | control.report_id, control.interface, data,
+                           control.report_length - ( control.report_id ? 0 : 1 ) );
+}
+
+/**
+ * Waits until a HID device has something to read
+ *
+ * @param fd       the HID device
+ * @param deadline monotonic_ns() after which to give up
+ *
+ * @return 1 if it has, 0 if the deadline passed, -1 with errno set if polling failed
+ */
+int wait_readable ( int fd, long long deadline )
+{
+    for ( ;; ) {
+        struct pollfd pending = { fd, POLLIN, 0 };
+        long long left = max ( deadline - monotonic_ns(), 0LL );
+        int ready = poll ( &pending, 1, ( left + 999999 ) / 1000000 );
+
+        if ( ready < 0 && errno == EINTR ) {
+            continue;
+        }
+
+        if ( ready > 0 && ! ( pending.revents & POLLIN ) ) {
+            errno = ENODEV;
+
+            return -1;
+        }
+
+        return ready;
+    }
+}
+
+/**
+ * Should a brightness control be read and written with the multi-usage hiddev ioctls?
+ *
+ * @param control the brightness control
+ *
+ * @return True if --usage-ioctls=multi was given, or by default when the control has several usages.
+ */
+bool use_multi_usage ( const BrightnessControl& control )
+{
+    return usageIoctls == USAGE_IOCTLS_MULTI || ( usageIoctls == USAGE_IOCTLS_AUTO && control.usage_count > 1 );
+}
+
+/**
+ * hiddev (/dev/usb/hiddevN): the kernel parses the reports for us, at the cost of HIDIOCINITREPORT on every open and
+ * two ioctls per brightness read or write, plus one per further usage of the brightness control unless they are all
+ * moved at once with HIDIOCGUSAGES or HIDIOCSUSAGES.
+ */
+struct HiddevBackend : DeviceBackend {
+    void version ( int fd, int* version )
+    {
+        hid_ioctl ( fd, HIDIOCGVERSION, version );
+    }
+
+    void device_info ( int fd, const char*, hiddev_devinfo& device_info )
+    {
+        hid_ioctl ( fd, HIDIOCGDEVINFO, &device_info );
+    }
+
+    bool is_monitor ( int fd, const hiddev_devinfo& device_info )
+    {
+        return is_usb_monitor ( device_info, fd );
+    }
+
+    /**
+     * A display we have seen before, whose brightness control is in the control cache, takes the fast path: no
+     * HIDIOCINITREPORT, which makes the kernel fetch every report from the display. Reads fetch the brightness report
+     * themselves, and so does the first write, unless a read came first.
+     */
+    bool init ( Display& display )
+    {
+        if ( display.identified && cached_brightness_control ( display ) ) {
+            display.fast = true;
+
+            return true;
+        }
+
+        /* Initialise the internal report structures */
+        if ( hid_ioctl ( display.fd, HIDIOCINITREPORT ) < 0 ) {
+            return false;
+        }
+
+        display.report_fetched = true;
+        setup_brightness_control ( display );
+
+        return true;
+    }
+
+    /**
+     * Fetches the brightness report from the display first, so that the usage holds the current brightness.
+     */
+    int read_brightness ( Display& display, int& brightness, const char*& failure )
+    {
+        struct hiddev_report_info rep_info;
+        struct hiddev_usage_ref_multi multi;
+
+        prepare ( display.control, rep_info, multi.uref );
+
+        if ( hid_ioctl ( display.fd, HIDIOCGREPORT, &rep_info ) < 0 ) {
+            failure = "Cannot read brightness";
+            return 3;
+        }
+
+        display.report_fetched = true;
+
+        if ( use_multi_usage ( display.control ) ) {
+            multi.num_values = display.control.usage_count;
+
+            if ( hid_ioctl ( display.fd, HIDIOCGUSAGES, &multi ) < 0 ) {
+                failure = "Cannot ask monitor for brightness control";
+                return 2;
+            }
+
+            brightness = multi.values[0];
+
+            return 0;
+        }
+
+        if ( hid_ioctl ( display.fd, HIDIOCGUSAGE, &multi.uref ) < 0 ) {
+            failure = "Cannot ask monitor for brightness control";
+            return 2;
+        }
+
+        brightness = multi.uref.value;
+
+        return 0;
+    }
+
+    /**
+     * Every usage of the brightness control gets the same value, before the report is sent once. The kernel sends the
+     * whole report, so on the fast path it's fetched from the display first; otherwise its other fields would be zero.
+     */
+    int write_brightness ( Display& display, int brightness, const char*& failure )
+    {
+        struct hiddev_report_info rep_info;
+        struct hiddev_usage_ref_multi multi;
+
+        prepare ( display.control, rep_info, multi.uref );
+
+        if ( !display.report_fetched ) {
+            if ( hid_ioctl ( display.fd, HIDIOCGREPORT, &rep_info ) < 0 ) {
+                failure = "Cannot read brightness";
+                return 3;
+            }
+
+            display.report_fetched = true;
+        }
+
+        if ( use_multi_usage ( display.control ) ) {
+            multi.num_values = display.control.usage_count;
+
+            for ( int i = 0; i < display.control.usage_count; ++i ) {
+                multi.values[i] = brightness;
+            }
+
+            if ( hid_ioctl ( display.fd, HIDIOCSUSAGES, &multi ) < 0 ) {
+                failure = "Cannot set brightness";
+                return 2;
+            }
+        } else {
+            multi.uref.value = brightness;
+
+            for ( int i = 0; i < display.control.usage_count; ++i ) {
+                multi.uref.usage_index = display.control.usage_index + i;
+
+                if ( hid_ioctl ( display.fd, HIDIOCSUSAGE, &multi.uref ) < 0 ) {
+                    failure = "Cannot set brightness";
+                    return 2;
+                }
+            }
+        }
+
+        if ( hid_ioctl ( display.fd, HIDIOCSREPORT, &rep_info ) < 0 ) {
+            failure = "Cannot set brightness";
+            return 3;
+        }
+
+        return 0;
+    }
+
+    /**
+     * Usage reference events carry the brightness whenever the kernel sees the brightness report: when the display
+     * sends it, and when anyone reads it with HIDIOCGREPORT.
+     */
+    bool watch_events ( Display& display )
+    {
+        int flags = HIDDEV_FLAG_UREF;
+
+        return hid_ioctl ( display.fd, HIDIOCSFLAG, &flags ) == 0;
+    }
+
+    int next_event ( Display& display, long long deadline, int& brightness )
+    {
+        struct hiddev_usage_ref events[ 64 ];
+
+        for ( ;; ) {
+            int ready = wait_readable ( display.fd, deadline );
+
+            if ( ready <= 0 ) {
+                return ready;
+            }
+
+            ssize_t length = read ( display.fd, events, sizeof ( events ) );
+            bool found = false;
+
+            if ( length < 0 && errno != EINTR && errno != EAGAIN ) {
+                return -1;
+            }
+
+            for ( ssize_t i = 0; i < length / ( ssize_t ) sizeof ( events[0] ); ++i ) {
+                if ( events[i].field_index != HID_FIELD_INDEX_NONE &&
+                        events[i].usage_code == display.control.usage_code ) {
+                    brightness = events[i].value;
+                    found = true;
+                }
+            }
+
+            if ( found ) {
+                return 1;
+            }
+        }
+    }
+
+    /**
+     * Fills in the report and usage references of the brightness control
+     */
+    static void prepare ( const BrightnessControl& control, hiddev_report_info& rep_info,
+                          hiddev_usage_ref& usage_ref )
+    {
+        memset ( &usage_ref, 0, sizeof ( usage_ref ) );
+        usage_ref.report_type = HID_REPORT_TYPE_FEATURE;
+        usage_ref.report_id = control.report_id;
+        usage_ref.field_index = control.field_index;
+        usage_ref.usage_index = control.usage_index;
+        usage_ref.usage_code = control.usage_code;
+
+        memset ( &rep_info, 0, sizeof ( rep_info ) );
+        rep_info.report_type = HID_REPORT_TYPE_FEATURE;
+        rep_info.report_id = control.report_id;
+        rep_info.num_fields = 1;
+    }
+};
+
+/**
+ * hidraw (/dev/hidrawN): we parse the report descriptor ourselves, and read or write the whole brightness feature
+ * report with a single HIDIOCGFEATURE or HIDIOCSFEATURE.
+ */
+struct HidrawBackend : DeviceBackend {
+    /**
+     * hidraw nodes only know the bus type, vendor and product; the rest of the device information is left zeroed.
+     */
+    void device_info ( int fd, const char*, hiddev_devinfo& device_info )
+    {
+        hidraw_devinfo raw_info;
+
+        memset ( &device_info, 0, sizeof ( device_info ) );
+
+        if ( hid_ioctl ( fd, HIDIOCGRAWINFO, &raw_info ) == 0 ) {
+            device_info.bustype = raw_info.bustype;
+            device_info.vendor = raw_info.vendor;
+            device_info.product = raw_info.product;
+        }
+    }
+
+    bool is_monitor ( int fd, const hiddev_devinfo& )
+    {
+        BrightnessControl control;
+        bool monitor;
+
+        hidraw_layout ( fd, monitor, control );
+
+        return monitor;
+    }
+
+    /**
+     * There are no report structures to initialise; the descriptor tells where the brightness is.
+     */
+    bool init ( Display& display )
+    {
+        bool monitor;
+
+        if ( !hidraw_layout ( display.fd, monitor, display.control ) ) {
+            errno = EOPNOTSUPP;
+
+            return false;
+        }
+
+        return true;
+    }
+
+    int read_brightness ( Display& display, int& brightness, const char*& failure )
+    {
+        const BrightnessControl& control = display.control;
+        vector<unsigned char> report ( control.report_length );
+
+        report[0] = control.report_id;
+
+        if ( hid_ioctl ( display.fd, HIDIOCGFEATURE ( report.size() ), &report[0] ) < 0 ) {
+            failure = "Cannot read brightness";
+            return 3;
+        }
+
+        brightness = report_field ( &report[0], control );
+
+        return 0;
+    }
+
+    /**
+     * When the brightness isn't all the report holds, the report is read first so the other fields keep their values.
+     */
+    int write_brightness ( Display& display, int brightness, const char*& failure )
+    {
+        const BrightnessControl& control = display.control;
+        vector<unsigned char> report ( control.report_length );
+
+        report[0] = control.report_id;
+
+        if ( !control.exclusive && hid_ioctl ( display.fd, HIDIOCGFEATURE ( report.size() ), &report[0] ) < 0 ) {
+            failure = "Cannot read brightness";
+            return 3;
+        }
+
+        set_report_field ( &report[0], control, brightness );
+
+        if ( hid_ioctl ( display.fd, HIDIOCSFEATURE ( report.size() ), &report[0] ) < 0 ) {
+            failure = "Cannot set brightness";
+            return 2;
+        }
+
+        return 0;
+    }
+
+    /**
+     * hidraw nodes always queue the input reports the display sends
+     */
+    bool watch_events ( Display& )
+    {
+        return true;
+    }
+
+    /**
+     * An input report carries the brightness if it has the brightness report's number and layout.
+     */
+    int next_event ( Display& display, long long deadline, int& brightness )
+    {
+        const BrightnessControl& control = display.control;
+        unsigned char report[ 4096 ];
+        // Unnumbered reports come without the report number
+        size_t skip = control.report_id ? 0 : 1;
+
+        report[0] = 0;
+
+        for ( ;; ) {
+            int ready = wait_readable ( display.fd, deadline );
+
+            if ( ready <= 0 ) {
+                return ready;
+            }
+
+            ssize_t length = read ( display.fd, report + skip, sizeof ( report ) - skip );
+
+            if ( length < 0 && errno != EINTR && errno != EAGAIN ) {
+                return -1;
+            }
+
+            if ( length + ( ssize_t ) skip >= control.report_length && report[0] == control.report_id ) {
+                brightness = report_field ( report, control );
+
+                return 1;
+            }
+        }
+    }
+};
+
+/**
+ * usbfs (/dev/bus/usb/BBB/DDD): HID class GET_REPORT and SET_REPORT control requests, bypassing the kernel's HID
+ * driver. Goes through the usbfs implementation in use, so that the fake usbfs can stand in for the kernel.
+ */
+struct UsbfsBackend : DeviceBackend {
+    /**
+     * usbfs refuses almost every ioctl on nodes which are not open for writing, so the open mode is ignored.
+     */
+    int open ( const char* path, int )
+    {
+        long long start = monotonic_ns();
+        int fd = usbfs->open ( path );
+
+        record_call ( fd, TRACE_OPEN, start, fd );
+
+        return fd;
+    }
+
+    void device_info ( int fd, const char* path, hiddev_devinfo& device_info )
+    {
+        usbfs_device_info ( fd, path, device_info );
+    }
+
+    /**
+     * The HID interfaces are only looked at for supported devices, so that we never claim an interface of some other
+     * device.
+     */
+    bool is_monitor ( int fd, const hiddev_devinfo& device_info )
+    {
+        BrightnessControl control;
+        bool monitor = false;
+
+        if ( is_supported ( device_info ) && usbfs_layout ( fd, monitor, control ) ) {
+            unsigned interface = control.interface;
+
+            usbfs->ioctl ( fd, USBDEVFS_RELEASEINTERFACE, &interface );
+        }
+
+        return monitor;
+    }
+
+    /**
+     * Claims the HID interface with the brightness control for ourselves.
+     */
+    bool init ( Display& display )
+    {
+        bool monitor;
+
+        return usbfs_layout ( display.fd, monitor, display.control );
+    }
+
+    int read_brightness ( Display& display, int& brightness, const char*& failure )
+    {
+        vector<unsigned char> report ( display.control.report_length );
+
+        if ( usbfs_get_report ( display.fd, display.control, &report[0] ) < 0 ) {
+            failure = "Cannot read brightness";
+            return 3;
+        }
+
+        brightness = report_field ( &report[0], display.control );
+
+        return 0;
+    }
+
+    int write_brightness ( Display& display, int brightness, const char*& failure )
+    {
+        vector<unsigned char> report ( display.control.report_length );
+
+        if ( !display.control.exclusive && usbfs_get_report ( display.fd, display.control, &report[0] ) < 0 ) {
+            failure = "Cannot read brightness";
+            return 3;
+        }
+
+        set_report_field ( &report[0], display.control, brightness );
+
+        if ( usbfs_set_report ( display.fd, display.control, &report[0] ) < 0 ) {
+            failure = "Cannot set brightness";
+            return 2;
+        }
+
+        return 0;
+    }
+
+    void release ( Display& display )
+    {
+        unsigned interface = display.control.interface;
+
+        usbfs->ioctl ( display.fd, USBDEVFS_RELEASEINTERFACE, &interface );
+    }
+
+    void close ( int fd )
+    {
+        long long start = monotonic_ns();
+
+        usbfs->close ( fd );
+        record_call ( fd, TRACE_CLOSE, start, 0 );
+    }
+};
+
+/**
+ * An in-process simulated display, named sim:<model>[,<option>=<value>...] in place of a HID device.
+ *
+ * Every operation costs as many simulated ioctls as it does with hiddev. Each simulated ioctl sleeps for the configured
+ * latency plus or minus a random jitter, and fails with EIO at the configured rate. Options:
+ *   latency=<us>    latency of every ioctl (default 0)
+ *   jitter=<us>     random variation of the latency (default 0)
+ *   init=<us>       extra latency of HIDIOCINITREPORT (default 0)
+ *   step=<n>        brightness granularity; written values are rounded to it (default 1)
+ *   usages=<n>      brightness usages of the control, like one per backlight zone (default 1)
+ *   event=<us>      how long after a write the display reports the new brightness as an event; -1 for never
+ *                   (default: the latency)
+ *   fail=<rate>     probability of a brightness ioctl failing, 0 to 1 (default 0)
+ *   open-fail=<rate> probability of open() failing (default 0)
+ *   serial=<serial> the USB serial number (default none)
+ *   trace=<n>       replay display n of the trace loaded by --replay: every simulated ioctl takes as long as, and fails
+ *                   like, the matching call in the trace, and brightness reads return the traced brightness. The
+ *                   usages are moved like in the trace, one at a time or all at once.
+ *
+ * All references to the same name share one display, so that brightness changes persist within the process.
+ */
+struct SimBackend : DeviceBackend {
+    bool           valid;
+    hiddev_devinfo info;
+    string         serial_number;
+    int            latency;
+    int            jitter;
+    int            init_latency;
+    int            step;
+    int            usages;
+    int            event_delay;
+    double         fail_rate;
+    double         open_fail_rate;
+    int            minimum;
+    int            maximum;
+    int            brightness;
+    const vector<TraceRecord>* trace;
+    bool           traced_multi;
+    size_t         position;
+    atomic<long>   calls;
+    mutex          lock;
+    mt19937        random;
+    // Brightness changes the display is going to report to each watching descriptor, and when
+    map< int, deque< pair<long long, int> > > events;
+
+    SimBackend ( const string& spec )
+        : valid ( true )
+        , latency ( 0 )
+        , jitter ( 0 )
+        , init_latency ( 0 )
+        , step ( 1 )
+        , usages ( 1 )
+        , event_delay ( -2 )
+        , fail_rate ( 0 )
+        , open_fail_rate ( 0 )
+        , minimum ( 400 )
+        , maximum ( 60000 )
+        , trace ( 0 )
+        , traced_multi ( false )
+        , position ( 0 )
+        , calls ( 0 )
+        , random ( hash<string>() ( spec ) )
+    {
+        stringstream options ( spec.substr ( 4 ) );
+        string model, option;
+
+        memset ( &info, 0, sizeof ( info ) );
+        info.bustype = BUS_USB;
+        info.vendor = APPLE;
+        info.num_applications = 1;
+
+        getline ( options, model, ',' );
+
+        if ( model == "studio" ) {
+            info.product = STUDIO_DISPLAY_27;
+        } else if ( model == "xdr" ) {
+            info.product = PRO_XDR_DISPLAY_32;
+        } else {
+            valid = false;
+        }
+
+        while ( getline ( options, option, ',' ) ) {
+            size_t equals = option.find ( '=' );
+            string name = option.substr ( 0, equals );
+            const char* value = equals == string::npos ? "" : option.c_str() + equals + 1;
+
+            if ( name == "latency" ) {
+                latency = atoi ( value );
+            } else if ( name == "jitter" ) {
+                jitter = atoi ( value );
+            } else if ( name == "init" ) {
+                init_latency = atoi ( value );
+            } else if ( name == "step" ) {
+                step = max ( atoi ( value ), 1 );
+            } else if ( name == "usages" && atoi ( value ) >= 1 && atoi ( value ) <= HID_MAX_MULTI_USAGES ) {
+                usages = atoi ( value );
+            } else if ( name == "event" && atoi ( value ) >= -1 ) {
+                event_delay = atoi ( value );
+            } else if ( name == "fail" ) {
+                fail_rate = atof ( value );
+            } else if ( name == "open-fail" ) {
+                open_fail_rate = atof ( value );
+            } else if ( name == "serial" ) {
+                serial_number = value;
+            } else if ( name == "trace" && ( size_t ) atoi ( value ) < replayTrace.displays.size() ) {
+                trace = &replayTrace.displays[ atoi ( value ) ];
+            } else {
+                valid = false;
+            }
+        }
+
+        brightness = quantize ( ( minimum + maximum ) / 2 );
+
+        if ( event_delay == -2 ) {
+            event_delay = latency;
+        }
+
+        // The traced display had as many usages as it set one after another
+        for ( size_t i = 0, run = 0; trace && i < trace->size(); ++i ) {
+            uint32_t request = ( *trace ) [i].request;
+
+            run = request == HIDIOCSUSAGE ? run + 1 : 0;
+            usages = max ( usages, ( int ) run );
+            traced_multi = traced_multi || request == HIDIOCGUSAGES || request == HIDIOCSUSAGES;
+        }
+    }
+
+    /**
+     * Are the usages moved all at once? When replaying, like in the trace.
+     */
+    bool multi_usage ( const Display& display )
+    {
+        return trace ? traced_multi : use_multi_usage ( display.control );
+    }
+
+    /**
+     * Rounds a brightness to the display's granularity and range
+     */
+    int quantize ( int value )
+    {
+        value = min ( max ( value, minimum ), maximum );
+
+        return minimum + ( value - minimum + step / 2 ) / step * step;
+    }
+
+    /**
+     * Finds the next call to a request in the trace being replayed. Traced calls before it which weren't made this time
+     * are skipped, and their time is added to its latency.
+     *
+     * Calls the trace doesn't have are answered immediately and successfully. Identity calls can be missing because
+     * the recorded run found the display in the detection cache; a missing brightness call is counted as a mismatch.
+     *
+     * @param request the ioctl request
+     * @param delay   set to the latency in microseconds
+     * @param error   set to the error of the traced call, or 0
+     * @param value   set to the traced brightness for brightness reads
+     */
+    void replay ( uint32_t request, long long& delay, int& error, int* value )
+    {
+        size_t next = position;
+
+        delay = 0;
+        error = 0;
+
+        while ( next < trace->size() && ( *trace ) [ next ].request != request ) {
+            ++next;
+        }
+
+        if ( next == trace->size() ) {
+            if ( request == HIDIOCINITREPORT || request == HIDIOCGUSAGE || request == HIDIOCSUSAGE ||
+                    request == HIDIOCGUSAGES || request == HIDIOCSUSAGES || request == HIDIOCGREPORT ||
+                    request == HIDIOCSREPORT ) {
+                ++replayTrace.missing;
+            }
+
+            return;
+        }
+
+        for ( ; position < next; ++position ) {
+            delay += ( *trace ) [ position ].duration;
+
+            if ( ( *trace ) [ position ].request < TRACE_OPEN ) {
+                ++replayTrace.skipped;
+            }
+        }
+
+        const TraceRecord& record = ( *trace ) [ position++ ];
+
+        ++replayTrace.replayed;
+        delay += record.duration;
+        error = record.result < 0 ? record.error : 0;
+
+        if ( value && ( request == HIDIOCGUSAGE || request == HIDIOCGUSAGES || request == TRACE_EVENT ) ) {
+            *value = record.value;
+        }
+    }
+
+    /**
+     * One simulated ioctl: waits for the latency, then fails at the given rate. Recorded with --record.
+     *
+     * @param fd      the simulated display; not recorded if negative
+     * @param request the ioctl request, or one of the TRACE_ kinds, it stands for
+     * @param rate    failure probability
+     * @param extra   additional latency in microseconds
+     * @param value   the brightness read or written, if any
+     *
+     * @return False if the ioctl failed, with errno set.
+     */
+    bool call ( int fd, uint32_t request, double rate, int extra = 0, int* value = 0 )
+    {
+        long long start = monotonic_ns();
+        long long delay;
+        int error = 0;
+
+        ++calls;
+
+        {
+            lock_guard<mutex> guard ( lock );
+            uniform_int_distribution<int> variation ( -jitter, jitter );
+            uniform_real_distribution<double> chance ( 0, 1 );
+
+            if ( trace ) {
+                replay ( request, delay, error, value );
+            } else {
+                delay = latency + extra + ( jitter ? variation ( random ) : 0 );
+                error = rate > 0 && chance ( random ) < rate ? EIO : 0;
+            }
+        }
+
+        if ( delay > 0 ) {
+            this_thread::sleep_for ( chrono::microseconds ( delay ) );
+        }
+
+        errno = error;
+
+        if ( fd >= 0 ) {
+            record_call ( fd, request, start, error ? -1 : 0, value ? *value : 0 );
+        }
+
+        return !error;
+    }
+
+    /**
+     * Simulated displays are timerfds: real descriptors which are not character devices, so they never end up in the
+     * detection cache. The timer goes off when the display reports a brightness change, so they can be polled for
+     * events like HID devices.
+     */
+    int open ( const char*, int )
+    {
+        long long start = monotonic_ns();
+
+        if ( !valid ) {
+            errno = EINVAL;
+
+            return -1;
+        }
+
+        int fd = call ( -1, TRACE_OPEN, open_fail_rate ) ?
+                 timerfd_create ( CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK ) : -1;
+
+        record_call ( fd, TRACE_OPEN, start, fd );
+
+        return fd;
+    }
+
+    void version ( int fd, int* version )
+    {
+        int value = 0x010004;
+
+        if ( call ( fd, HIDIOCGVERSION, 0, 0, &value ) ) {
+            *version = value;
+        }
+    }
+
+    void device_info ( int fd, const char*, hiddev_devinfo& device_info )
+    {
+        int product = info.product & 0xFFFF;
+
+        call ( fd, HIDIOCGDEVINFO, 0, 0, &product );
+        device_info = info;
+    }
+
+    string serial ( int, const hiddev_devinfo& )
+    {
+        return serial_number;
+    }
+
+    bool is_monitor ( int fd, const hiddev_devinfo& )
+    {
+        return call ( fd, HIDIOCAPPLICATION, 0 );
+    }
+
+    bool init ( Display& display )
+    {
+        if ( !call ( display.fd, HIDIOCINITREPORT, 0, init_latency ) ) {
+            return false;
+        }
+
+        display.control.minimum = minimum;
+        display.control.maximum = maximum;
+        display.control.usage_count = usages;
+
+        return true;
+    }
+
+    int read_brightness ( Display& display, int& value, const char*& failure )
+    {
+        {
+            lock_guard<mutex> guard ( lock );
+
+            value = brightness;
+        }
+
+        if ( !call ( display.fd, HIDIOCGREPORT, fail_rate ) ) {
+            failure = "Cannot read brightness";
+            return 3;
+        }
+
+        if ( !call ( display.fd, multi_usage ( display ) ? HIDIOCGUSAGES : HIDIOCGUSAGE, fail_rate, 0, &value ) ) {
+            failure = "Cannot ask monitor for brightness control";
+            return 2;
+        }
+
+        return 0;
+    }
+
+    int write_brightness ( Display& display, int value, const char*& failure )
+    {
+        value = quantize ( value );
+
+        if ( multi_usage ( display ) ) {
+            if ( !call ( display.fd, HIDIOCSUSAGES, fail_rate, 0, &value ) ) {
+                failure = "Cannot set brightness";
+                return 2;
+            }
+        } else {
+            for ( int i = 0; i < display.control.usage_count; ++i ) {
+                if ( !call ( display.fd, HIDIOCSUSAGE, fail_rate, 0, &value ) ) {
+                    failure = "Cannot set brightness";
+                    return 2;
+                }
+            }
+        }
+
+        if ( !call ( display.fd, HIDIOCSREPORT, fail_rate ) ) {
+            failure = "Cannot set brightness";
+            return 3;
+        }
+
+        lock_guard<mutex> guard ( lock );
+
+        brightness = value;
+
+        if ( event_delay >= 0 ) {
+            for ( map< int, deque< pair<long long, int> > >::iterator it = events.begin(); it != events.end(); ++it ) {
+                it->second.push_back ( make_pair ( monotonic_ns() + event_delay * 1000LL, value ) );
+
+                if ( it->second.size() == 1 ) {
+                    arm ( it->first );
+                }
+            }
+        }
+
+        return 0;
+    }
+
+    bool watch_events ( Display& display )
+    {
+        if ( !trace && event_delay < 0 ) {
+            errno = ENOTSUP;
+
+            return false;
+        }
+
+        lock_guard<mutex> guard ( lock );
+
+        events[ display.fd ];
+
+        return true;
+    }
+
+    /**
+     * Sets a descriptor's timer to when its next brightness change is due, or stops it. Called with the lock held.
+     */
+    void arm ( int fd )
+    {
+        const deque< pair<long long, int> >& pending = events[ fd ];
+        struct itimerspec timer;
+
+        memset ( &timer, 0, sizeof ( timer ) );
+
+        if ( !pending.empty() ) {
+            // Zero would stop the timer
+            long long due = max ( pending.front().first, 1LL );
+
+            timer.it_value.tv_sec = due / 1000000000;
+            timer.it_value.tv_nsec = due % 1000000000;
+        }
+
+        timerfd_settime ( fd, TFD_TIMER_ABSTIME, &timer, 0 );
+    }
+
+    /**
+     * Replays take as long as, and end like, the traced wait.
+     */
+    int next_event ( Display& display, long long deadline, int& value )
+    {
+        if ( trace ) {
+            long long delay;
+            int error;
+
+            // Draining, not waiting
+            if ( deadline <= monotonic_ns() ) {
+                return 0;
+            }
+
+            {
+                lock_guard<mutex> guard ( lock );
+
+                replay ( TRACE_EVENT, delay, error, &value );
+            }
+
+            this_thread::sleep_for ( chrono::microseconds ( delay ) );
+
+            return error ? 0 : 1;
+        }
+
+        for ( ;; ) {
+            {
+                lock_guard<mutex> guard ( lock );
+                deque< pair<long long, int> >& pending = events[ display.fd ];
+
+                if ( !pending.empty() && pending.front().first <= monotonic_ns() ) {
+                    value = pending.front().second;
+                    pending.pop_front();
+                    arm ( display.fd );
+
+                    return 1;
+                }
+            }
+
+            int ready = wait_readable ( display.fd, deadline );
+            uint64_t expirations;
+
+            if ( ready <= 0 ) {
+                return ready;
+            }
+
+            if ( read ( display.fd, &expirations, sizeof ( expirations ) ) < 0 && errno != EAGAIN ) {
+                return -1;
+            }
+        }
+    }
+
+    void close ( int fd )
+    {
+        {
+            lock_guard<mutex> guard ( lock );
+
+            events.erase ( fd );
+        }
+
+        DeviceBackend::close ( fd );
+    }
+};
+
+HiddevBackend hiddevBackend;
+HidrawBackend hidrawBackend;
+UsbfsBackend usbfsBackend;
+
+/**
+ * Simulated displays by name
+ */
+struct SimDisplays {
+    map< string, unique_ptr<SimBackend> > displays;
+    mutex                                 lock;
+};
+
+SimDisplays simDisplays;
+
+/**
+ * Is this HID device argument a simulated display?
+ *
+ * @return Whether the argument starts with sim:
+ */
+bool is_simulated ( const char* path )
+{
+    return strncmp ( path, "sim:", 4 ) == 0;
+}
+
+/**
+ * Tells which kind of HID device node a path is
+ *
+ * @param path HID device path, not a simulated display
+ *
+ * @return BACKEND_USBFS for /dev/bus/usb/BBB/DDD nodes, BACKEND_HIDRAW for /dev/hidrawN nodes, BACKEND_HIDDEV otherwise
+ */
+int node_backend ( const char* path )
+{
+    const char* name = strrchr ( path, '/' );
+
+    if ( strstr ( path, "/bus/usb/" ) ) {
+        return BACKEND_USBFS;
+    }
+
+    if ( strncmp ( name ? name + 1 : path, "hidraw", 6 ) == 0 ) {
+        return BACKEND_HIDRAW;
+    }
+
+    return BACKEND_HIDDEV;
+}
+
+/**
+ * Returns the backend which accesses a HID device
+ *
+ * @param path HID device path
+ *
+ * @return The simulated display for sim: names, otherwise the backend for the kind of node (see node_backend())
+ */
+DeviceBackend* backend_for ( const char* path )
+{
+    if ( is_simulated ( path ) ) {
+        lock_guard<mutex> guard ( simDisplays.lock );
+        unique_ptr<SimBackend>& display = simDisplays.displays[ path ];
+
+        if ( !display ) {
+            display.reset ( new SimBackend ( path ) );
+        }
+
+        return display.get();
+    }
+
+    switch ( node_backend ( path ) ) {
+    case BACKEND_USBFS:
+        return &usbfsBackend;
+
+    case BACKEND_HIDRAW:
+        return &hidrawBackend;
+
+    default:
+        return &hiddevBackend;
+    }
+}
+
+/**
+ * Opens, identifies and initialises a HID device.
+ *
+ * This is the per-device setup sequence: open(), reading the device information, the supported device and USB monitor
+ * checks, and initialisation (for hiddev, HIDIOCINITREPORT) including finding the brightness control, each done by
+ * the device's backend. On failure the file descriptor is closed again. When the detection cache knows the device,
+ * the identification steps are skipped, and devices we would reject are not opened at all; backends can then take a
+ * fast path for initialisation too.
+ *
+ * @param path      HID device path
+ * @param open_mode flags for open()
+ * @param force     accept devices which are not in the supported devices database
+ * @param display   receives the opened device
+ * @param version   if not null, receives the hiddev driver version
+ * @param fast      whether to trust the detection cache for the fast path; false ignores it altogether
+ *
+ * @return PROBE_OK on success, one of the other PROBE_* constants otherwise.
+ */
+int open_display ( const char* path, int open_mode, bool force, Display& display, int* version = 0, bool fast = true )
+{
+    display = Display();
+    display.path = path;
+
+    // A display name which could not be resolved to a device node
+    if ( is_display_name ( path ) ) {
+        errno = ENODEV;
+
+        return PROBE_OPEN_FAILED;
+    }
+
+    Identity identity;
+    bool cached = fast && cached_identity ( path, identity );
+
+    display.device_info = identity.device_info;
+    display.identified = cached;
+    display.serial = identity.serial;
+
+    // A cache hit tells us which devices we are not interested in without even opening them
+    if ( cached && !is_supported ( display.device_info ) && !force ) {
+        return PROBE_UNSUPPORTED;
+    }
+
+    if ( cached && !identity.monitor ) {
+        return PROBE_NOT_MONITOR;
+    }
+
+    display.backend = backend_for ( path );
+
+    if ( ( display.fd = display.backend->open ( path, open_mode ) ) < 0 ) {
+        return PROBE_OPEN_FAILED;
+    }
+
+    if ( version ) {
+        display.backend->version ( display.fd, version );
+    }
+
+    if ( !cached ) {
+        display.backend->device_info ( display.fd, path, identity.device_info );
+        display.device_info = identity.device_info;
+    } else {
+        // Not asked for with a cache hit; a trace still needs to tell which display this is
+        record_call ( display.fd, TRACE_IDENTITY, monotonic_ns(), 0, display.device_info.product & 0xFFFF,
+                      display.device_info.vendor & 0xFFFF );
+    }
+
+    if ( ! ( display.device = is_supported ( display.device_info ) ) && !force ) {
+        identity.monitor = display.backend->is_monitor ( display.fd, display.device_info );
+        remember_identity ( display.fd, path, display.backend, identity );
+        display.backend->close ( display.fd );
+        display.fd = -1;
+
+        return PROBE_UNSUPPORTED;
+    }
+
+    if ( !cached ) {
+        identity.monitor = display.backend->is_monitor ( display.fd, display.device_info );
+        remember_identity ( display.fd, path, display.backend, identity );
+        display.serial = identity.serial;
+    }
+
+    if ( !identity.monitor ) {
+        display.backend->close ( display.fd );
+        display.fd = -1;
+
+        return PROBE_NOT_MONITOR;
+    }
+
+    if ( !display.backend->init ( display ) ) {
+        int error = errno;
+
+        display.backend->close ( display.fd );
+        display.fd = -1;
+        errno = error;
+
+        return PROBE_INIT_FAILED;
+    }
+
+    return PROBE_OK;
+}
+
+/**
+ * Closes a display opened with open_display()
+ *
+ * @param display the display to close
+ */
+void close_display ( Display& display )
+{
+    if ( display.fd >= 0 ) {
+        display.backend->release ( display );
+        display.backend->close ( display.fd );
+    }
+
+    display.fd = -1;
+}
+
+/**
+ * Identifies a HID device without initialising it: its device information, whether it's a USB monitor, and its
+ * serial number.
+ *
+ * The detection cache is used if possible; otherwise the device is probed and the result cached.
+ *
+ * @param path     HID device path
+ * @param identity receives the identity
+ * @param version  if not null and the device had to be opened, receives the hiddev driver version
+ *
+ * @return False if the device can't be opened, with errno set.
+ */
+bool probe_identity ( const char* path, Identity& identity, int* version = 0 )
+{
+    if ( cached_identity ( path, identity ) ) {
+        return true;
+    }
+
+    DeviceBackend* backend = backend_for ( path );
+    int fd = backend->open ( path, O_RDONLY );
+
+    if ( fd < 0 ) {
+        return false;
+    }
+
+    /* ioctl() accesses the underlying driver */
+    if ( version ) {
+        backend->version ( fd, version );
+    }
+
+    // Get the device information
+    backend->device_info ( fd, path, identity.device_info );
+
+    identity.monitor = backend->is_monitor ( fd, identity.device_info );
+    remember_identity ( fd, path, backend, identity );
+
+    backend->close ( fd );
+
+    return true;
+}
+
+/**
+ * Returns the path of the display aliases file.
+ *
+ * @return $XDG_CONFIG_HOME/asdcontrol/aliases or ~/.config/asdcontrol/aliases, or an empty string.
+ */
+string aliases_path()
+{
+    const char* dir = getenv ( "XDG_CONFIG_HOME" );
+
+    if ( dir && *dir ) {
+        return string ( dir ) + "/asdcontrol/aliases";
+    }
+
+    if ( ( dir = getenv ( "HOME" ) ) && *dir ) {
+        return string ( dir ) + "/.config/asdcontrol/aliases";
+    }
+
+    return "";
+}
+
+/**
+ * Looks up the serial number a display alias stands for.
+ *
+ * Each line of the aliases file holds an alias and a serial number separated by white space. Empty lines and lines
+ * starting with # are ignored.
+ *
+ * @param alias the alias, without the leading @
+ *
+ * @return The serial number, or an empty string if the alias is not defined.
+ */
+string alias_serial ( const string& alias )
+{
+    string path = aliases_path();
+    FILE* file = path.empty() ? 0 : fopen ( path.c_str(), "re" );
+    char line[ 512 ], name[ 256 ], serial[ 256 ];
+    string result;
+
+    if ( !file ) {
+        return result;
+    }
+
+    while ( result.empty() && fgets ( line, sizeof ( line ), file ) ) {
+        if ( line[0] != '#' && sscanf ( line, "%255s %255s", name, serial ) == 2 && alias == name ) {
+            result = serial;
+        }
+    }
+
+    fclose ( file );
+
+    return result;
+}
+
+/**
+ * Finds the HID device of a display by its USB serial number.
+ *
+ * The detection cache is the index: a node it associates with the serial number is verified with a single stat().
+ * Only if that fails are the supported displays enumerated through sysfs, and those not in the cache yet probed.
+ *
+ * @param serial the USB serial number
+ * @param path   receives the HID device path
+ *
+ * @return False if no connected display has this serial number.
+ */
+bool find_display_by_serial ( const string& serial, string& path )
+{
+    vector<string> candidates;
+
+    {
+        lock_guard<mutex> guard ( detectionCache.lock );
+
+        for ( CacheEntries::const_iterator it = detectionCache.entries.begin(); it != detectionCache.entries.end();
+                ++it ) {
+            if ( it->second.identity.serial == serial ) {
+                candidates.push_back ( it->second.path );
+            }
+        }
+    }
+
+    for ( size_t i = 0; i < candidates.size(); ++i ) {
+        Identity identity;
+
+        if ( cached_identity ( candidates[i].c_str(), identity ) && identity.serial == serial ) {
+            path = candidates[i];
+
+            return true;
+        }
+    }
+
+    candidates = enumerate_displays ( sysfsRoot );
+
+    for ( size_t i = 0; i < candidates.size(); ++i ) {
+        Identity identity;
+
+        if ( probe_identity ( candidates[i].c_str(), identity ) && identity.serial == serial ) {
+            path = candidates[i];
+            save_detection_cache();
+
+            return true;
+        }
+    }
+
+    save_detection_cache();
+
+    return false;
+}
+
+/**
+ * Resolves a display name (serial:<serial number> or @<alias>) to the display's HID device.
+ *
+ * @param name the display name
+ * @param path receives the HID device path
+ *
+ * @return False if the name doesn't resolve to a connected display.
+ */
+bool resolve_display_name ( const string& name, string& path )
+{
+    string serial = ( name[0] == '@' ) ? alias_serial ( name.substr ( 1 ) ) : name.substr ( 7 );
+
+    return !serial.empty() && find_display_by_serial ( serial, path );
+}
+
+/**
+ * Expands the HID device arguments which are still shell patterns, and resolves display names.
+ *
+ * When no device node matches, the shell passes a pattern such as /dev/usb/hiddev* through unexpanded. Once the
+ * devices have appeared we expand it ourselves. Display names which don't resolve are kept as they are.
+ *
+ * @param files HID device arguments
+ *
+ * @return The device paths
+ */
+vector<string> expand_devices ( const FileList& files )
+{
+    vector<string> paths;
+
+    for ( FileList::const_iterator it = files.begin(); it != files.end(); ++it ) {
+        glob_t matches;
+        string path;
+
+        if ( is_display_name ( *it ) ) {
+            paths.push_back ( resolve_display_name ( *it, path ) ? path : *it );
+
+            continue;
+        }
+
+        if ( strpbrk ( *it, "*?[" ) && glob ( *it, 0, 0, &matches ) == 0 ) {
+            for ( size_t i = 0; i < matches.gl_pathc; ++i ) {
+                paths.push_back ( matches.gl_pathv[i] );
+            }
+
+            globfree ( &matches );
+
+            continue;
+        }
+
+        paths.push_back ( *it );
+    }
+
+    return paths;
+}
+
+/**
+ * Is at least one of the HID devices (or, with auto detection, any HID device) a supported display we can open?
+ *
+ * @param files       HID device arguments
+ * @param auto_detect also look for supported displays through sysfs
+ * @param sysfs_root  where sysfs is mounted
+ *
+ * @return True if a supported display is ready
+ */
+bool display_present ( const FileList& files, bool auto_detect, const string& sysfs_root )
+{
+    vector<string> candidates = expand_devices ( files );
+
+    if ( auto_detect ) {
+        vector<string> enumerated = enumerate_displays ( sysfs_root );
+
+        candidates.insert ( candidates.end(), enumerated.begin(), enumerated.end() );
+    }
+
+    for ( size_t i = 0; i < candidates.size(); ++i ) {
+        Display display;
+
+        if ( open_display ( candidates[i].c_str(), O_RDONLY, false, display ) == PROBE_OK ) {
+            close_display ( display );
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Where the device nodes of a kind of HID device appear, for --wait-for-device
+ */
+struct NodeDirectory {
+    string path;     // the directory
+    string prefix;   // what the names of the device nodes in it start with
+    int    watch;    // inotify watch descriptor, or -1 while the directory doesn't exist
+    bool   buses;    // holds a directory per USB bus instead, which are watched as they appear
+};
+
+/**
+ * Lists the directories the device nodes of a kind of HID device appear in
+ *
+ * @param backend    one of the BACKEND_ constants
+ * @param directories receives the directories, unless already listed
+ */
+void node_directories ( int backend, vector<NodeDirectory>& directories )
+{
+    vector<NodeDirectory> wanted;
+
+    if ( backend == BACKEND_USBFS ) {
+        DIR* buses = opendir ( "/dev/bus/usb" );
+        struct dirent* entry;
+
+        wanted.push_back ( { "/dev/bus/usb", "", -1, true } );
+
+        while ( buses && ( entry = readdir ( buses ) ) ) {
+            if ( entry->d_name[0] != '.' ) {
+                wanted.push_back ( { string ( "/dev/bus/usb/" ) + entry->d_name, "", -1, false } );
+            }
+        }
+
+        if ( buses ) {
+            closedir ( buses );
+        }
+    } else if ( backend == BACKEND_HIDRAW ) {
+        wanted.push_back ( { "/dev", "hidraw", -1, false } );
+    } else {
+        wanted.push_back ( { "/dev", "hiddev", -1, false } );
+        wanted.push_back ( { "/dev/usb", "hiddev", -1, false } );
+    }
+
+    for ( size_t i = 0; i < wanted.size(); ++i ) {
+        bool listed = false;
+
+        for ( size_t j = 0; j < directories.size(); ++j ) {
+            listed = listed || ( directories[j].path == wanted[i].path && directories[j].prefix == wanted[i].prefix );
+        }
+
+        if ( !listed ) {
+            directories.push_back ( wanted[i] );
+        }
+    }
+}
+
+/**
+ * Waits until a supported display is ready, without polling.
+ *
+ * The directories the HID device nodes appear in are watched with inotify for nodes being created, or having their
+ * permissions changed by udev: those of the kind of each device given, and those of --backend with auto detection
+ * (see node_directories()). The devices are only checked again when that happens.
+ *
+ * @param files       HID device arguments
+ * @param auto_detect also look for supported displays through sysfs
+ * @param sysfs_root  where sysfs is mounted
+ * @param timeout     maximum time to wait in milliseconds; negative to wait forever
+ *
+ * @return False if we timed out.
+ */
+bool wait_for_device ( const FileList& files, bool auto_detect, const string& sysfs_root, int timeout )
+{
+    const uint32_t events = IN_CREATE | IN_ATTRIB | IN_MOVED_TO;
+    int fd = inotify_init1 ( IN_CLOEXEC | IN_NONBLOCK );
+    vector<NodeDirectory> directories;
+
+    if ( auto_detect ) {
+        node_directories ( deviceBackend, directories );
+    }
+
+    // Display names are resolved through sysfs, like with auto detection
+    for ( FileList::const_iterator it = files.begin(); it != files.end(); ++it ) {
+        if ( !is_simulated ( *it ) ) {
+            node_directories ( is_display_name ( *it ) ? deviceBackend : node_backend ( *it ), directories );
+        }
+    }
+
+    // Set up the watches before checking, so that we can't miss a device appearing in between
+    for ( size_t i = 0; fd >= 0 && i < directories.size(); ++i ) {
+        directories[i].watch = inotify_add_watch ( fd, directories[i].path.c_str(), events );
+    }
+
+    long long deadline = monotonic_ms() + timeout;
+    bool present;
+
+    while ( ! ( present = display_present ( files, auto_detect, sysfs_root ) ) && fd >= 0 ) {
+        bool relevant = false;
+
+        while ( !relevant ) {
+            int remaining = timeout < 0 ? -1 : ( int ) max ( 0LL, deadline - monotonic_ms() );
+            pollfd ready = { fd, POLLIN, 0 };
+
+            if ( poll ( &ready, 1, remaining ) == 0 ) {
+                close ( fd );
+
+                return false;
+            }
+
+            char buffer[ 4096 ] __attribute__ ( ( aligned ( __alignof__ ( struct inotify_event ) ) ) );
+            ssize_t length = read ( fd, buffer, sizeof ( buffer ) );
+
+            for ( ssize_t offset = 0; offset < length; ) {
+                const inotify_event* event = ( const inotify_event* ) ( buffer + offset );
+                vector<NodeDirectory> buses;
+
+                for ( size_t i = 0; event->len && i < directories.size(); ++i ) {
+                    NodeDirectory& directory = directories[i];
+
+                    if ( directory.watch == event->wd && directory.buses && ( event->mask & IN_ISDIR ) ) {
+                        string bus = directory.path + "/" + event->name;
+
+                        buses.push_back ( { bus, "", inotify_add_watch ( fd, bus.c_str(), events ), false } );
+                        relevant = true;
+                    } else if ( directory.watch == event->wd &&
+                                strncmp ( event->name, directory.prefix.c_str(), directory.prefix.size() ) == 0 ) {
+                        relevant = true;
+                    }
+
+                    // Directories like /dev/usb are only created when the first device node in them shows up
+                    if ( directory.watch < 0 && ( event->mask & IN_ISDIR ) ) {
+                        for ( size_t j = 0; j < directories.size(); ++j ) {
+                            if ( directories[j].watch == event->wd &&
+                                    directories[j].path + "/" + event->name == directory.path ) {
+                                directory.watch = inotify_add_watch ( fd, directory.path.c_str(), events );
+                                relevant = true;
+                            }
+                        }
+                    }
+                }
+
+                directories.insert ( directories.end(), buses.begin(), buses.end() );
+                offset += sizeof ( inotify_event ) + event->len;
+            }
+        }
+    }
+
+    if ( fd >= 0 ) {
+        close ( fd );
+    }
+
+    return present;
+}
+
+/**
+ * Makes a display report its brightness changes as events, and drops the events which are already pending.
+ *
+ * @param display the opened display
+ *
+ * @return False if the display can't report events, with errno set
+ */
+bool watch_brightness ( Display& display )
+{
+    int brightness;
+
+    if ( !display.watching && !display.backend->watch_events ( display ) ) {
+        return false;
+    }
+
+    display.watching = true;
+
+    while ( display.backend->next_event ( display, monotonic_ns(), brightness ) > 0 ) { }
+
+    return true;
+}
+
+/**
+ * Waits for a display to report its brightness as an event, after watch_brightness(). Recorded with --record.
+ *
+ * @param display    the watched display
+ * @param timeout    how long to wait, in milliseconds
+ * @param brightness receives the reported brightness
+ *
+ * @return 1 if the display reported its brightness, 0 if it didn't in time, -1 with errno set if waiting failed
+ */
+int wait_brightness ( Display& display, int timeout, int& brightness )
+{
+    long long start = monotonic_ns();
+    int result = display.backend->next_event ( display, start + timeout * 1000000LL, brightness );
+
+    if ( result == 0 ) {
+        errno = ETIMEDOUT;
+    }
+
+    record_call ( display.fd, TRACE_EVENT, start, result > 0 ? 0 : -1, result > 0 ? brightness : 0 );
+
+    return result;
+}
+
+/**
+ * Looks up a consistency level by name
+ *
+ * @param name        fire-and-forget, readback or event
+ * @param consistency receives the matching CONSISTENCY_ constant
+ *
+ * @return False if there is no such consistency level
+ */
+bool parse_consistency ( const string& name, int& consistency )
+{
+    for ( int i = CONSISTENCY_NONE; i <= CONSISTENCY_EVENT; ++i ) {
+        if ( name == consistencyNames[i] ) {
+            consistency = i;
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Does a brightness request print the brightness?
+ *
+ * @param mode        USAGE_MODE_GET, USAGE_MODE_SET, or USAGE_MODE_SETREL
+ * @param consistency what a brightness change waits for, one of the CONSISTENCY_ constants
+ *
+ * @return False for absolute changes which don't wait for the display to confirm them
+ */
+bool reports_brightness ( int mode, int consistency )
+{
+    return mode != USAGE_MODE_SET || consistency == CONSISTENCY_READBACK || consistency == CONSISTENCY_EVENT;
+}
+
+/**
+ * Gets, sets, or relatively changes the brightness of an opened display.
+ *
+ * What a change waits for before it counts as done depends on the consistency level:
+ *   CONSISTENCY_NONE      nothing; the brightness is what was written (two hiddev ioctls, plus two to read the
+ *                         current brightness of a relative change)
+ *   CONSISTENCY_READBACK  the brightness is read back from the display (two more hiddev ioctls)
+ *   CONSISTENCY_EVENT     the display reports the new brightness as an event; if it doesn't within EVENT_TIMEOUT,
+ *                         or can't report events, the brightness is read back
+ *
+ * @param display     the opened display
+ * @param mode        USAGE_MODE_GET, USAGE_MODE_SET, or USAGE_MODE_SETREL
+ * @param value       absolute brightness for USAGE_MODE_SET, brightness change for USAGE_MODE_SETREL
+ * @param percent     whether value is a percentage of the display's brightness range
+ * @param consistency one of the CONSISTENCY_ constants; CONSISTENCY_DEFAULT is CONSISTENCY_NONE for USAGE_MODE_SET
+ *                    and CONSISTENCY_READBACK for USAGE_MODE_SETREL
+ * @param brightness  receives the brightness read from, written to, or reported by the display
+ * @param failure     receives a description of the failed step, suitable for perror()
+ *
+ * @return 0 on success, otherwise the program exit status for the failed step with errno set.
+ */
+int apply_brightness ( Display& display, int mode, int value, bool percent, int consistency, int& brightness,
+                       const char*& failure )
+{
+    const BrightnessControl& control = display.control;
+    int status;
+
+    if ( percent ) {
+        int span = control.maximum - control.minimum;
+
+        if ( mode == USAGE_MODE_SET ) {
+            value = ( min ( max ( value, 0 ), 100 ) * span / 100 ) + control.minimum;
+        } else {
+            value = value * span / 100;
+        }
+    }
+
+    if ( consistency == CONSISTENCY_DEFAULT ) {
+        consistency = mode == USAGE_MODE_SET ? CONSISTENCY_NONE : CONSISTENCY_READBACK;
+    }
+
+    int target = value;
+
+    if ( mode != USAGE_MODE_SET ) {
+        if ( ( status = display.backend->read_brightness ( display, brightness, failure ) ) ) {
+            return status;
+        }
+
+        if ( mode != USAGE_MODE_SETREL ) {
+            return 0;
+        }
+
+        target = brightness + value;
+        target = max ( control.minimum, target );
+        target = min ( control.maximum, target );
+    }
+
+    // Events already pending don't tell anything about this change
+    bool events = consistency == CONSISTENCY_EVENT && watch_brightness ( display );
+
+    /* set calculated brightness */
+    if ( ( status = display.backend->write_brightness ( display, target, failure ) ) ) {
+        return status;
+    }
+
+    brightness = target;
+
+    if ( consistency == CONSISTENCY_NONE || ( events && wait_brightness ( display, EVENT_TIMEOUT, brightness ) > 0 ) ) {
+        return 0;
+    }
+
+    /* read brightness back from device */
+    return display.backend->read_brightness ( display, brightness, failure );
+}
+
+/**
+ * Prints help for the program.
+ *
+ * @param programName this program name
+ */
+void help ( const char *programName )
+{
+    printf ( "asdcontrol " VERSION "\n" );
+
+    printf ( "USAGE: %1$s [--silent|-s] [--brief|-b] [--help|-h] [--about|-a] "
+             "[--detect|-d] [--first] [--list-all |-l] "
+             "[--auto] [--sysfs-root=<path>] [--no-cache] [--wait-for-device[=<seconds>]] "
+             "[--backend=hiddev|hidraw|usbfs] [--usage-ioctls=auto|single|multi] "
+             "[--consistency=fire-and-forget|readback|event] [--watch[=plain|json]] "
+             "[--daemon] [--socket=<path>] [--idle-timeout=<seconds>] "
+             "[--hotplug] [--uevent-socket=<path>] [--no-daemon] "
+             "[--fake-usbfs[=<file>]] [--record=<file>] [--replay=<file>] "
+             "<hid device(s)> [<brightness>]\n\n"
+             "Parameters:\n"
+             "  --silent,-s\n"
+             "         Suppress non-functional program output.\n"
+             "  --brief,-b\n"
+             "         Don't print the brightness after setting it.\n"
+             "  --detect, -d\n"
+             "         Detect the correct HID device. See the examples.\n"
+             "         With --brief, only the paths of supported displays are printed.\n"
+             "  --first\n"
+             "         With --detect, stop at the first supported display found.\n"
+             "  --list-all, -l\n"
+             "         List supported devices.\n"
+             "  --auto\n"
+             "         Find the HID devices of all supported displays through sysfs, without\n"
+             "         opening any other HID device. Can be used instead of <hid device(s)>.\n"
+             "  --sysfs-root=<path>\n"
+             "         Where sysfs is mounted for --auto. Default: /sys\n"
+             "  --no-cache\n"
+             "         Probe every HID device instead of using the detection cache.\n"
+             "  --wait-for-device[=<seconds>]\n"
+             "         Wait until a supported display is connected before getting or setting\n"
+             "         the brightness; optionally give up after this many seconds.\n"
+             "  --backend=hiddev|hidraw|usbfs\n"
+             "         Which HID device nodes --auto and --hotplug look for. Default: hiddev\n"
+             "         Nodes given in the command line are accessed through the interface\n"
+             "         they belong to: /dev/hidrawX through hidraw, /dev/bus/usb/BBB/DDD\n"
+             "         through usbfs control requests, all others through hiddev.\n"
+             "  --usage-ioctls=auto|single|multi\n"
+             "         Move the brightness usages with one hiddev ioctl each (single), or all\n"
+             "         at once with HIDIOCGUSAGES/HIDIOCSUSAGES (multi). Default: auto, which\n"
+             "         uses multi for displays with more than one brightness usage.\n"
+             "  --consistency=fire-and-forget|readback|event\n"
+             "         What setting the brightness waits for: nothing, reading the brightness\n"
+             "         back, or the display reporting it (read back if it doesn't within a\n"
+             "         second). Absolute changes only print the brightness if they wait.\n"
+             "         Default: fire-and-forget for absolute and readback for relative changes.\n"
+             "  --watch[=plain|json]\n"
+             "         Keep the displays open, print their brightness, and print it again\n"
+             "         whenever it changes, as plain text or one JSON object per line. For\n"
+             "         status bars. Watches through the daemon if one is running.\n"
+             "  --fake-usbfs[=<file>]\n"
+             "         Access usbfs nodes through an in-process fake Studio Display, keeping its\n"
+             "         brightness in <file>. Implies --no-cache. For testing.\n"
+             "  --record=<file>\n"
+             "         Write every call to the HID devices, with its result and timing, to a\n"
+             "         trace file. Implies --no-daemon. With --daemon, records the calls of\n"
+             "         all requests, writing them out after each one.\n"
+             "  --replay=<file>\n"
+             "         Repeat the invocation recorded in a trace file against simulated displays\n"
+             "         which respond like the recorded ones did, and compare the timing.\n"
+             "  --daemon\n"
+             "         Open and initialise the given HID devices once, then answer brightness\n"
+             "         requests on a Unix socket until terminated. Supports systemd socket\n"
+             "         activation.\n"
+             "  --socket=<path>\n"
+             "         Unix socket of the daemon. Default: $ASDCONTROL_SOCKET, or\n"
+             "         $XDG_RUNTIME_DIR/asdcontrol.sock, or /run/asdcontrol.sock.\n"
+             "         When a daemon is listening there, brightness requests are sent to it.\n"
+             "  --hotplug\n"
+             "         Make the daemon pick up displays as they are connected, and restore their\n"
+             "         last brightness.\n"
+             "  --uevent-socket=<path>\n"
+             "         With --hotplug, read uevents from this Unix datagram socket instead of\n"
+             "         the kernel. For testing.\n"
+             "  --idle-timeout=<seconds>\n"
+             "         Make the daemon exit after this many seconds without requests.\n"
+             "  --no-daemon\n"
+             "         Always access the HID devices directly, even if a daemon is running.\n"
+             "  --help,-h\n"
+             "         Show this help message and quit.\n"
+             "  --about,-a\n"
+             "         Show copyright and license information about the program.\n"
+             "  <hid device(s)>\n"
+             "         Path to the HID device that represents your Apple Studio Display.\n"
+             "         It's usually one of the /dev/usb/hiddevX or /dev/hiddevX device files.\n"
+             "         Use /dev/usb/hiddev* or /dev/hiddev* to go through all HID devices on\n"
+             "         your system.\n"
+             "         A display can also be named by its USB serial number, as serial:<serial>,\n"
+             "         or by an alias from ~/.config/asdcontrol/aliases, as @<alias>.\n"
+             "      Note\n"
+             "         You must have write permissions to this device.\n"
+             "      Note\n"
+             "         It should be safe to run the program on other device than Apple Studio\n"
              "         Display as the program checks whether the device is compatible and\n"
              "         warns about it.\n"
              "         \n"
@@ -329,67 +4115,1826 @@ void help ( const char *programName )
              "         -- -1000\n"
              "      See also: --brief option.\n"
 
-             "\n\nEXAMPLES:\n\n"
-             "The following examples assyme your HID device is /dev/usb/hiddev0.\n"
-             "Your device could be a different /dev/usb/hiddevX or /dev/hiddevX.\n"
-             "To auto-detect your device, use /dev/usb/hiddev* or /dev/hiddev*, depending on your\n"
-             "system. Note: this only works right if you have only one Apple Studio Display monitor.\n"
-             "\n"
-             "  %1$s\n"
-             "  %1$s --help\n"
-             "      Show this help message.\n"
-             "\n"
-             "  %1$s --detect /dev/usb/hiddev*\n"
-             "      Try to detect which HID device belongs to your Apple Studio Display.\n"
-             "\n"
-             "  %1$s /dev/usb/hiddev0\n"
-             "      Read the current brightness parameter\n"
-             "\n"
-             "  %1$s /dev/usb/hiddev0 20000\n"
-             "      Set brightness to 20000. The brightness value depends on your model. \n"
-             "      For the 2022 Apple Studio Display it's a number between 400 and 60000.\n"
-             "\n"
-             "  %1$s /dev/usb/hiddev0 +1000\n"
-             "      Increment the current brightness by 1000.\n"
-             "\n"
-             "  %1$s /dev/usb/hiddev0 -- -1000\n"
-             "      Decrement the current brightness by 1000. Please note the '--'!\n"
-             ,
+             "\n\nEXAMPLES:\n\n"
+             "The following examples assyme your HID device is /dev/usb/hiddev0.\n"
+             "Your device could be a different /dev/usb/hiddevX or /dev/hiddevX.\n"
+             "To auto-detect your device, use /dev/usb/hiddev* or /dev/hiddev*, depending on your\n"
+             "system. Note: this only works right if you have only one Apple Studio Display monitor.\n"
+             "\n"
+             "  %1$s\n"
+             "  %1$s --help\n"
+             "      Show this help message.\n"
+             "\n"
+             "  %1$s --detect /dev/usb/hiddev*\n"
+             "      Try to detect which HID device belongs to your Apple Studio Display.\n"
+             "\n"
+             "  %1$s --auto 50%%\n"
+             "      Set all connected supported displays to half brightness.\n"
+             "\n"
+             "  %1$s /dev/usb/hiddev0\n"
+             "      Read the current brightness parameter\n"
+             "\n"
+             "  %1$s /dev/usb/hiddev0 20000\n"
+             "      Set brightness to 20000. The brightness value depends on your model. \n"
+             "      For the 2022 Apple Studio Display it's a number between 400 and 60000.\n"
+             "\n"
+             "  %1$s /dev/usb/hiddev0 +1000\n"
+             "      Increment the current brightness by 1000.\n"
+             "\n"
+             "  %1$s /dev/usb/hiddev0 -- -1000\n"
+             "      Decrement the current brightness by 1000. Please note the '--'!\n"
+             "\n"
+             "  %1$s --daemon /dev/usb/hiddev*\n"
+             "      Keep all supported displays open and serve brightness requests.\n"
+             ,
+
+             programName );
+}
+
+/** Prints brief notice about the program */
+void notice()
+{
+    printf ( "ASDControl " VERSION " -- Apple Studio Display Brightness Control\n"
+             "Copyright (c) 2023-2024 Nicholas K. Dionysopoulos\n\n"
+           );
+}
+
+/** Prints detailed info about this program */
+void about()
+{
+    printf ( "ASDControl " VERSION " -- Apple Studio Display Brightness Control\n"
+             "Copyright (c) 2023-2024 Nicholas K. Dionysopoulos\n\n"
+
+             "This program is free software; you can redistribute it and/or modify\n"
+             "it under the terms of the GNU General Public License as published by\n"
+             "the Free Software Foundation; either version 2 of the License, or\n"
+             "(at your option) any later version.\n\n"
+
+             "This program is distributed in the hope that it will be useful,\n"
+             "but WITHOUT ANY WARRANTY; without even the implied warranty of\n"
+             "MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the\n"
+             "GNU General Public License for more details.\n\n"
+
+             "You should have received a copy of the GNU General Public License\n"
+             "along with this program; if not, write to the Free Software\n"
+             "Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA\n\n"
+
+             "CREDITS:\n"
+             "  Based on acdcontrol, written by Pavel Gurevich.\n\n"
+           );
+}
+
+/** Set by the signal handler when the daemon should shut down */
+volatile sig_atomic_t daemon_quit = 0;
+
+/** Signal handler for SIGINT and SIGTERM in daemon mode */
+void daemon_signal ( int )
+{
+    daemon_quit = 1;
+}
+
+/**
+ * Returns the default path of the control daemon's Unix socket.
+ *
+ * This is $ASDCONTROL_SOCKET if set, otherwise asdcontrol.sock in $XDG_RUNTIME_DIR, otherwise /run/asdcontrol.sock
+ *
+ * @return The socket path
+ */
+string default_socket_path()
+{
+    const char* env = getenv ( "ASDCONTROL_SOCKET" );
+
+    if ( env && *env ) {
+        return env;
+    }
+
+    env = getenv ( "XDG_RUNTIME_DIR" );
+
+    if ( env && *env ) {
+        return string ( env ) + "/asdcontrol.sock";
+    }
+
+    return "/run/asdcontrol.sock";
+}
+
+/**
+ * Fills in a Unix socket address
+ *
+ * @param address receives the address
+ * @param path    socket path
+ *
+ * @return False if the path is too long for a Unix socket address.
+ */
+bool socket_address ( sockaddr_un& address, const string& path )
+{
+    memset ( &address, 0, sizeof ( address ) );
+    address.sun_family = AF_UNIX;
+
+    if ( path.size() >= sizeof ( address.sun_path ) ) {
+        errno = ENAMETOOLONG;
+
+        return false;
+    }
+
+    strcpy ( address.sun_path, path.c_str() );
+
+    return true;
+}
+
+/**
+ * Creates the daemon's listening socket.
+ *
+ * A stale socket file left behind by a crashed daemon is removed, but we refuse to take over the socket of a daemon
+ * which is still running.
+ *
+ * @param path socket path
+ *
+ * @return The listening socket, or -1 with errno set.
+ */
+int listen_socket ( const string& path )
+{
+    sockaddr_un address;
+
+    if ( !socket_address ( address, path ) ) {
+        return -1;
+    }
+
+    int fd = socket ( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+
+    if ( fd < 0 ) {
+        return -1;
+    }
+
+    if ( connect ( fd, ( sockaddr* ) &address, sizeof ( address ) ) == 0 ) {
+        close ( fd );
+        errno = EADDRINUSE;
+
+        return -1;
+    }
+
+    close ( fd );
+    unlink ( path.c_str() );
+
+    if ( ( fd = socket ( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 ) ) < 0 ) {
+        return -1;
+    }
+
+    if ( bind ( fd, ( sockaddr* ) &address, sizeof ( address ) ) < 0 || listen ( fd, 16 ) < 0 ) {
+        int error = errno;
+
+        close ( fd );
+        errno = error;
+
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Returns the listening socket passed in by the service manager, using the systemd socket activation protocol.
+ *
+ * @return The listening socket, or -1 if we were not socket activated.
+ */
+int activated_socket()
+{
+    const char* pid = getenv ( "LISTEN_PID" );
+    const char* fds = getenv ( "LISTEN_FDS" );
+
+    if ( !pid || !fds || atol ( pid ) != getpid() || atoi ( fds ) < 1 ) {
+        return -1;
+    }
+
+    // The first passed file descriptor is always 3 (SD_LISTEN_FDS_START)
+    const int fd = 3;
+
+    fcntl ( fd, F_SETFD, FD_CLOEXEC );
+
+    unsetenv ( "LISTEN_PID" );
+    unsetenv ( "LISTEN_FDS" );
+    unsetenv ( "LISTEN_FDNAMES" );
+
+    return fd;
+}
+
+/**
+ * Describes why open_display() failed, the same way the command line tool reports it.
+ *
+ * @param display the display which failed to open
+ * @param status  the PROBE_* result of open_display()
+ *
+ * @return The error message
+ */
+string probe_error ( const Display& display, int status )
+{
+    ostringstream message;
+
+    switch ( status ) {
+    case PROBE_OPEN_FAILED:
+        message << display.path << ": " << strerror ( errno );
+        break;
+
+    case PROBE_UNSUPPORTED:
+        message << "Unsupported device:" << format_device ( display.device_info );
+        break;
+
+    case PROBE_NOT_MONITOR:
+        message << display.path << ": This device is not a USB monitor!";
+        break;
+
+    case PROBE_INIT_FAILED:
+        message << "FATAL: Failed to initialize internal report structures";
+        break;
+    }
+
+    string result = message.str();
+
+    while ( !result.empty() && result[ result.size() - 1 ] == '\n' ) {
+        result.erase ( result.size() - 1 );
+    }
+
+    return result;
+}
+
+/**
+ * Returns the program exit status the command line tool uses for an open_display() failure.
+ *
+ * Zero means the device is skipped and the remaining devices are still processed.
+ *
+ * @param status the PROBE_* result of open_display()
+ *
+ * @return The exit status
+ */
+int probe_exit_status ( int status )
+{
+    switch ( status ) {
+    case PROBE_UNSUPPORTED:
+        return 2;
+
+    case PROBE_INIT_FAILED:
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * How the daemon was asked to run
+ */
+struct DaemonOptions {
+    string socket_path;
+    int    idle_timeout;
+    bool   silent;
+    bool   hotplug;
+    string uevent_socket;
+};
+
+/**
+ * Everything the daemon keeps between requests
+ */
+struct DaemonState {
+    DisplayTable           displays;
+    map<string, int>       last_brightness;
+    map<string, long long> retry_at;
+    map<string, int>       retry_delay;
+    bool                   silent;
+
+    // Clients to tell about brightness changes, and the brightness they were told last, by HID device
+    map< string, set<int> > subscribers;
+    map<string, int>        reported;
+};
+
+/**
+ * Tells the clients which subscribed to a HID device about its brightness, if it changed since they were told last.
+ *
+ * Each client gets a line "CHANGED <brightness> <device>". Clients which can't keep up miss the line rather than
+ * holding up the daemon.
+ *
+ * @param state      the daemon's state
+ * @param device     the HID device, as the clients named it
+ * @param brightness its brightness
+ */
+void notify_subscribers ( DaemonState& state, const string& device, int brightness )
+{
+    map< string, set<int> >::const_iterator it = state.subscribers.find ( device );
+    map<string, int>::iterator reported = state.reported.find ( device );
+
+    if ( it == state.subscribers.end() || ( reported != state.reported.end() && reported->second == brightness ) ) {
+        return;
+    }
+
+    state.reported[ device ] = brightness;
+
+    string line = "CHANGED " + to_string ( brightness ) + " " + device + "\n";
+
+    for ( set<int>::const_iterator client = it->second.begin(); client != it->second.end(); ++client ) {
+        send ( *client, line.data(), line.size(), MSG_NOSIGNAL | MSG_DONTWAIT );
+    }
+}
+
+/**
+ * Forgets the subscriptions of a client which went away
+ *
+ * @param state  the daemon's state
+ * @param client the client's socket
+ */
+void unsubscribe ( DaemonState& state, int client )
+{
+    map< string, set<int> >::iterator it = state.subscribers.begin();
+
+    while ( it != state.subscribers.end() ) {
+        it->second.erase ( client );
+
+        if ( it->second.empty() ) {
+            state.reported.erase ( it->first );
+            state.subscribers.erase ( it++ );
+        } else {
+            ++it;
+        }
+    }
+}
+
+/**
+ * Returns a key which identifies a physical display across replugs, under which the daemon remembers its brightness.
+ *
+ * This is the display's serial number if it has one, otherwise its vendor and product ID.
+ *
+ * @param display the display
+ *
+ * @return The key
+ */
+string display_key ( const Display& display )
+{
+    char key[ 16 ];
+
+    if ( !display.serial.empty() ) {
+        return "serial:" + display.serial;
+    }
+
+    snprintf ( key, sizeof ( key ), "%04x:%04x", display.device_info.vendor & 0xFFFF,
+               display.device_info.product & 0xFFFF );
+
+    return key;
+}
+
+/**
+ * Opens the kernel uevent socket, or the local stand-in datagram socket used instead of it for testing.
+ *
+ * @param standin path of a Unix datagram socket to receive uevents on; empty for the kernel's netlink socket
+ *
+ * @return The socket, or -1 with errno set.
+ */
+int uevent_socket ( const string& standin )
+{
+    int fd;
+
+    if ( !standin.empty() ) {
+        sockaddr_un address;
+
+        if ( !socket_address ( address, standin ) || ( fd = socket ( AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0 ) ) < 0 ) {
+            return -1;
+        }
+
+        unlink ( standin.c_str() );
+
+        if ( bind ( fd, ( sockaddr* ) &address, sizeof ( address ) ) < 0 ) {
+            int error = errno;
+
+            close ( fd );
+            errno = error;
+
+            return -1;
+        }
+
+        return fd;
+    }
+
+    sockaddr_nl address;
+
+    memset ( &address, 0, sizeof ( address ) );
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = 1; // Kernel events; devtmpfs has created the device node by the time we get them
+
+    if ( ( fd = socket ( AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT ) ) < 0 ) {
+        return -1;
+    }
+
+    if ( bind ( fd, ( sockaddr* ) &address, sizeof ( address ) ) < 0 ) {
+        int error = errno;
+
+        close ( fd );
+        errno = error;
+
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Opens a hotplugged HID device, adds it to the daemon's display table and restores the display's last brightness.
+ *
+ * The device node may not be accessible yet if udev hasn't applied its permissions; such nodes are retried with an
+ * increasing delay.
+ *
+ * @param state the daemon's state
+ * @param node  HID device path
+ */
+void hotplug_add ( DaemonState& state, const string& node )
+{
+    Display display;
+    int status = open_display ( node.c_str(), O_RDWR, false, display );
+
+    if ( status == PROBE_OPEN_FAILED && ( errno == EACCES || errno == EPERM || errno == ENOENT ) ) {
+        int delay = state.retry_delay.count ( node ) ? state.retry_delay[ node ] * 2 : 10;
+
+        if ( delay <= 5000 ) {
+            state.retry_delay[ node ] = delay;
+            state.retry_at[ node ] = monotonic_ms() + delay;
+
+            return;
+        }
+    }
+
+    state.retry_delay.erase ( node );
+    state.retry_at.erase ( node );
+
+    if ( status != PROBE_OK ) {
+        if ( !state.silent && status != PROBE_UNSUPPORTED && status != PROBE_NOT_MONITOR ) {
+            fprintf ( stderr, "%s\n", probe_error ( display, status ).c_str() );
+        }
+
+        return;
+    }
+
+    DisplayTable::iterator it = state.displays.find ( node );
+
+    if ( it != state.displays.end() ) {
+        close_display ( it->second );
+    }
+
+    state.displays[ node ] = display;
+    save_detection_cache();
+
+    if ( !state.silent ) {
+        printf ( "%s: connected [%s]\n", node.c_str(), display.device->description );
+    }
+
+    map<string, int>::const_iterator last = state.last_brightness.find ( display_key ( display ) );
+
+    if ( last != state.last_brightness.end() ) {
+        const char* failure = "";
+        int brightness;
+
+        if ( apply_brightness ( state.displays[ node ], USAGE_MODE_SET, last->second, false, CONSISTENCY_NONE,
+                                brightness, failure ) != 0 ) {
+            fprintf ( stderr, "%s: %s: %s\n", node.c_str(), failure, strerror ( errno ) );
+
+            return;
+        }
+
+        notify_subscribers ( state, node, brightness );
+
+        if ( !state.silent ) {
+            printf ( "%s: restored BRIGHTNESS=%d\n", node.c_str(), brightness );
+        }
+    }
+}
+
+/**
+ * Handles one kernel uevent: hiddev (or hidraw, or usbfs) nodes which appear are probed and added to the display
+ * table, and displays which disappear are closed.
+ *
+ * @param state  the daemon's state
+ * @param buffer the uevent: a header line followed by NUL separated KEY=value pairs
+ * @param length length of the uevent
+ */
+void handle_uevent ( DaemonState& state, const char* buffer, size_t length )
+{
+    map<string, string> properties;
+
+    for ( size_t offset = 0; offset < length; ) {
+        string item ( buffer + offset, strnlen ( buffer + offset, length - offset ) );
+        size_t equals = item.find ( '=' );
+
+        if ( equals != string::npos ) {
+            properties[ item.substr ( 0, equals ) ] = item.substr ( equals + 1 );
+        }
+
+        offset += item.size() + 1;
+    }
+
+    const string& devname = properties[ "DEVNAME" ];
+    const string& action = properties[ "ACTION" ];
+
+    if ( deviceBackend == BACKEND_USBFS ) {
+        if ( properties[ "SUBSYSTEM" ] != "usb" || properties[ "DEVTYPE" ] != "usb_device" ) {
+            return;
+        }
+    } else if ( deviceBackend == BACKEND_HIDRAW ) {
+        if ( properties[ "SUBSYSTEM" ] != "hidraw" || devname.find ( "hidraw" ) == string::npos ) {
+            return;
+        }
+    } else if ( properties[ "SUBSYSTEM" ] != "usbmisc" || devname.find ( "hiddev" ) == string::npos ) {
+        return;
+    }
+
+    string node = "/dev/" + devname;
+
+    if ( action == "add" ) {
+        state.retry_delay.erase ( node );
+        hotplug_add ( state, node );
+    } else if ( action == "remove" ) {
+        DisplayTable::iterator it = state.displays.find ( node );
+
+        state.retry_delay.erase ( node );
+        state.retry_at.erase ( node );
+
+        if ( it != state.displays.end() ) {
+            close_display ( it->second );
+            state.displays.erase ( it );
+
+            if ( !state.silent ) {
+                printf ( "%s: disconnected\n", node.c_str() );
+            }
+        }
+    }
+}
+
+/**
+ * Handles one request line received by the daemon.
+ *
+ * Requests are one of
+ *   GET <device>
+ *   SET [<consistency>] <brightness>[%] <device>
+ *   SETREL [<consistency>] <+/-amount>[%] <device>
+ *   SUBSCRIBE <device>
+ * and are answered with "OK <brightness>" or "ERR <exit status> <message>". The consistency level is fire-and-forget,
+ * readback or event; see apply_brightness(). Devices which are not open yet are opened and initialised on first use,
+ * and kept open afterwards.
+ *
+ * SUBSCRIBE is answered with "OK <brightness> <minimum> <maximum>", the latter being the display's brightness range,
+ * and from then on the client is told about every change of the brightness (see notify_subscribers()): those made
+ * through the daemon, and those the display reports as events, which includes changes made by other programs when
+ * they read the brightness back.
+ *
+ * @param state  the daemon's state
+ * @param line   the request, without the trailing newline
+ * @param client the client's socket
+ *
+ * @return The reply, without the trailing newline
+ */
+string daemon_request ( DaemonState& state, const string& line, int client )
+{
+    DisplayTable& displays = state.displays;
+    ostringstream reply;
+    size_t space = line.find ( ' ' );
+    string verb = line.substr ( 0, space );
+    string argument = ( space == string::npos ) ? "" : line.substr ( space + 1 );
+    int mode;
+    int value = 0;
+    bool percent = false;
+    int consistency = CONSISTENCY_DEFAULT;
+
+    if ( verb == "GET" || verb == "SUBSCRIBE" ) {
+        mode = USAGE_MODE_GET;
+    } else if ( verb == "SET" || verb == "SETREL" ) {
+        mode = ( verb == "SET" ) ? USAGE_MODE_SET : USAGE_MODE_SETREL;
+        space = argument.find ( ' ' );
+
+        // Optional consistency level before the brightness
+        if ( space != string::npos && parse_consistency ( argument.substr ( 0, space ), consistency ) ) {
+            argument = argument.substr ( space + 1 );
+            space = argument.find ( ' ' );
+        }
+
+        string amount = argument.substr ( 0, space );
+
+        if ( space == string::npos || !number ( amount.c_str() ) ) {
+            return "ERR 1 Invalid brightness";
+        }
+
+        value = atoi ( amount.c_str() );
+        percent = isPercent ( amount.c_str() );
+        argument = argument.substr ( space + 1 );
+    } else {
+        return "ERR 1 Unknown request";
+    }
+
+    if ( argument.empty() ) {
+        return "ERR 1 No device given";
+    }
+
+    if ( is_display_name ( argument.c_str() ) && !resolve_display_name ( argument, argument ) ) {
+        return "ERR 1 No such display";
+    }
+
+    /* Retry once with a freshly opened device if the kept handle went stale, e.g. after a replug */
+    for ( int attempt = 0; attempt < 2; ++attempt ) {
+        DisplayTable::iterator it = displays.find ( argument );
+
+        if ( it == displays.end() ) {
+            Display display;
+            int status = open_display ( argument.c_str(), O_RDWR, false, display, 0, attempt == 0 );
+
+            if ( status != PROBE_OK ) {
+                reply << "ERR " << probe_exit_status ( status ) << " " << probe_error ( display, status );
+
+                return reply.str();
+            }
+
+            it = displays.insert ( make_pair ( argument, display ) ).first;
+            save_detection_cache();
+        }
+
+        const char* failure = "";
+        int brightness = 0;
+        int status = apply_brightness ( it->second, mode, value, percent, consistency, brightness, failure );
+
+        if ( status == 0 ) {
+            state.last_brightness[ display_key ( it->second ) ] = brightness;
+            reply << "OK " << brightness;
+
+            // The events of this change which already came in are no news to anyone
+            int echo = 0;
+
+            while ( it->second.watching && it->second.backend->next_event ( it->second, monotonic_ns(), echo ) > 0 ) {
+            }
+
+            notify_subscribers ( state, argument, brightness );
+
+            if ( verb == "SUBSCRIBE" ) {
+                // Without events only the changes made through the daemon get reported
+                watch_brightness ( it->second );
+                state.subscribers[ argument ].insert ( client );
+                state.reported[ argument ] = brightness;
+
+                reply << " " << it->second.control.minimum << " " << it->second.control.maximum;
+            }
+
+            return reply.str();
+        }
+
+        int error = errno;
+
+        close_display ( it->second );
+        displays.erase ( it );
+
+        if ( attempt == 0 && ( error == ENODEV || error == EIO || error == ENXIO ) ) {
+            continue;
+        }
+
+        reply << "ERR " << status << " " << failure << ": " << strerror ( error );
+
+        return reply.str();
+    }
+
+    return "ERR 1 Device is gone";
+}
+
+/**
+ * Runs the control daemon.
+ *
+ * The given devices are opened and initialised once. Afterwards the daemon answers brightness requests on a Unix
+ * socket (see daemon_request()), so every request only costs the brightness ioctls themselves.
+ *
+ * When started through socket activation the listening socket is taken over from the service manager instead of being
+ * created. With an idle timeout the daemon exits once no request has arrived for that long; the service manager will
+ * start it again on the next connection.
+ *
+ * With hotplug support the daemon listens for kernel uevents, so displays which are connected later are opened as soon
+ * as their hiddev node appears, and get back the brightness they last had.
+ *
+ * @param options how to run
+ * @param files   HID devices to open up front
+ *
+ * @return The program exit status
+ */
+int run_daemon ( const DaemonOptions& options, const FileList& files )
+{
+    DaemonState state;
+    DisplayTable& displays = state.displays;
+    const string& socket_path = options.socket_path;
+    bool silent = options.silent;
+    int idle_timeout = options.idle_timeout;
+    int uevents = -1;
+    map<int, string> clients;
+    struct sigaction action;
+
+    memset ( &action, 0, sizeof ( action ) );
+    action.sa_handler = daemon_signal;
+    sigaction ( SIGINT, &action, 0 );
+    sigaction ( SIGTERM, &action, 0 );
+    signal ( SIGPIPE, SIG_IGN );
+
+    // The log goes to the journal line by line, not whenever the buffer fills up
+    setvbuf ( stdout, 0, _IOLBF, 0 );
+
+    for ( FileList::const_iterator it = files.begin(); it != files.end(); ++it ) {
+        Display display;
+        int status = open_display ( *it, O_RDWR, false, display );
+
+        if ( status != PROBE_OK ) {
+            if ( !silent ) {
+                fprintf ( stderr, "%s\n", probe_error ( display, status ).c_str() );
+            }
+
+            continue;
+        }
+
+        if ( !silent ) {
+            printf ( "%s: ready [%s]\n", *it, display.device->description );
+        }
+
+        displays[ *it ] = display;
+    }
+
+    save_detection_cache();
+    state.silent = silent;
+
+    if ( options.hotplug && ( uevents = uevent_socket ( options.uevent_socket ) ) < 0 ) {
+        perror ( "Cannot listen for hotplug events" );
+
+        return 1;
+    }
+
+    int listener = activated_socket();
+    bool activated = listener >= 0;
+
+    if ( !activated && ( listener = listen_socket ( socket_path ) ) < 0 ) {
+        perror ( socket_path.c_str() );
+
+        return 1;
+    }
+
+    if ( !silent ) {
+        if ( activated ) {
+            printf ( "Listening on the socket passed by the service manager\n" );
+        } else {
+            printf ( "Listening on %s\n", socket_path.c_str() );
+        }
+    }
+
+    long long last_activity = monotonic_ms();
+
+    while ( !daemon_quit ) {
+        vector<pollfd> fds;
+        pollfd listener_poll = { listener, POLLIN, 0 };
+        pollfd uevent_poll = { uevents, POLLIN, 0 };
+
+        fds.push_back ( listener_poll );
+        fds.push_back ( uevent_poll );
+
+        for ( map<int, string>::iterator it = clients.begin(); it != clients.end(); ++it ) {
+            pollfd client_poll = { it->first, POLLIN, 0 };
+            fds.push_back ( client_poll );
+        }
+
+        // Then the displays somebody subscribed to, watched again if they were reopened since
+        size_t first_display = fds.size();
+        vector<string> watched;
+
+        for ( map< string, set<int> >::iterator it = state.subscribers.begin(); it != state.subscribers.end(); ++it ) {
+            DisplayTable::iterator display = displays.find ( it->first );
+
+            if ( display != displays.end() && ( display->second.watching || watch_brightness ( display->second ) ) ) {
+                pollfd display_poll = { display->second.fd, POLLIN, 0 };
+                fds.push_back ( display_poll );
+                watched.push_back ( it->first );
+            }
+        }
+
+        int timeout = -1;
+
+        // Only go idle while nobody is connected
+        if ( idle_timeout > 0 && clients.empty() ) {
+            long long remaining = last_activity + idle_timeout * 1000LL - monotonic_ms();
+
+            if ( remaining <= 0 ) {
+                if ( !silent ) {
+                    printf ( "Idle for %d seconds, exiting\n", idle_timeout );
+                }
+
+                break;
+            }
+
+            timeout = ( int ) remaining;
+        }
+
+        for ( map<string, long long>::iterator it = state.retry_at.begin(); it != state.retry_at.end(); ++it ) {
+            int remaining = ( int ) max ( 0LL, it->second - monotonic_ms() );
+
+            timeout = ( timeout < 0 ) ? remaining : min ( timeout, remaining );
+        }
+
+        int ready = poll ( &fds[0], fds.size(), timeout );
+
+        if ( ready < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+
+            perror ( "poll" );
+            break;
+        }
+
+        if ( fds[0].revents & POLLIN ) {
+            int client = accept4 ( listener, 0, 0, SOCK_CLOEXEC );
+
+            if ( client >= 0 ) {
+                clients[ client ] = "";
+            }
+        }
+
+        if ( fds[1].revents & POLLIN ) {
+            char buffer[ 8192 ];
+            sockaddr_storage sender;
+            socklen_t sender_length = sizeof ( sender );
+            ssize_t length = recvfrom ( uevents, buffer, sizeof ( buffer ), 0, ( sockaddr* ) &sender, &sender_length );
+
+            // Only trust netlink messages sent by the kernel itself
+            if ( length > 0 && ( sender.ss_family != AF_NETLINK || ( ( sockaddr_nl* ) &sender )->nl_pid == 0 ) ) {
+                handle_uevent ( state, buffer, length );
+            }
+        }
+
+        vector<string> due;
+
+        for ( map<string, long long>::iterator it = state.retry_at.begin(); it != state.retry_at.end(); ++it ) {
+            if ( it->second <= monotonic_ms() ) {
+                due.push_back ( it->first );
+            }
+        }
+
+        for ( size_t i = 0; i < due.size(); ++i ) {
+            state.retry_at.erase ( due[i] );
+            hotplug_add ( state, due[i] );
+        }
+
+        for ( size_t i = first_display; i < fds.size(); ++i ) {
+            DisplayTable::iterator display = displays.find ( watched[ i - first_display ] );
+            int brightness = 0;
+            int latest = -1;
+            int result = 0;
+
+            if ( !fds[i].revents || display == displays.end() ) {
+                continue;
+            }
+
+            // Only the latest of a burst of changes matters
+            while ( ( result = display->second.backend->next_event ( display->second, monotonic_ns(),
+                               brightness ) ) > 0 ) {
+                latest = brightness;
+            }
+
+            if ( latest >= 0 ) {
+                state.last_brightness[ display_key ( display->second ) ] = latest;
+                notify_subscribers ( state, display->first, latest );
+            }
+
+            // Unplugged; hotplug or the next request opens it again
+            if ( result < 0 || ( fds[i].revents & ( POLLERR | POLLHUP | POLLNVAL ) ) ) {
+                close_display ( display->second );
+                displays.erase ( display );
+            }
+        }
+
+        for ( size_t i = 2; i < first_display; ++i ) {
+            if ( !fds[i].revents ) {
+                continue;
+            }
+
+            char buffer[ 512 ];
+            ssize_t length = read ( fds[i].fd, buffer, sizeof ( buffer ) );
+
+            if ( length <= 0 ) {
+                close ( fds[i].fd );
+                clients.erase ( fds[i].fd );
+                unsubscribe ( state, fds[i].fd );
+
+                continue;
+            }
+
+            string& pending = clients[ fds[i].fd ];
+            string replies;
+            size_t newline;
+
+            pending.append ( buffer, length );
+
+            if ( pending.size() > 4096 && pending.find ( '\n' ) == string::npos ) {
+                close ( fds[i].fd );
+                clients.erase ( fds[i].fd );
+                unsubscribe ( state, fds[i].fd );
+
+                continue;
+            }
+
+            while ( ( newline = pending.find ( '\n' ) ) != string::npos ) {
+                replies += daemon_request ( state, pending.substr ( 0, newline ), fds[i].fd ) + "\n";
+                pending.erase ( 0, newline + 1 );
+
+                // Only requests count as activity; hotplug events and display events don't
+                last_activity = monotonic_ms();
+            }
+
+            // Before answering, so that the client finds the calls of its requests in the trace
+            flush_recording();
+
+            if ( !replies.empty() ) {
+                send ( fds[i].fd, replies.data(), replies.size(), MSG_NOSIGNAL );
+            }
+        }
+    }
+
+    for ( map<int, string>::iterator it = clients.begin(); it != clients.end(); ++it ) {
+        close ( it->first );
+    }
+
+    for ( DisplayTable::iterator it = displays.begin(); it != displays.end(); ++it ) {
+        close_display ( it->second );
+    }
+
+    close ( listener );
+
+    if ( uevents >= 0 ) {
+        close ( uevents );
+    }
+
+    if ( !options.uevent_socket.empty() ) {
+        unlink ( options.uevent_socket.c_str() );
+    }
+
+    // A socket activated listener belongs to the service manager, which keeps listening while we are not running
+    if ( !activated ) {
+        unlink ( socket_path.c_str() );
+    }
+
+    return 0;
+}
+
+/**
+ * Connects to a running control daemon.
+ *
+ * @param path socket path
+ *
+ * @return The connected socket, or -1 if no daemon is listening there.
+ */
+int connect_daemon ( const string& path )
+{
+    sockaddr_un address;
+
+    if ( !socket_address ( address, path ) ) {
+        return -1;
+    }
+
+    int fd = socket ( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+
+    if ( fd < 0 ) {
+        return -1;
+    }
+
+    if ( connect ( fd, ( sockaddr* ) &address, sizeof ( address ) ) < 0 ) {
+        close ( fd );
+
+        return -1;
+    }
+
+    // Don't let a wedged daemon hang a key binding forever
+    struct timeval timeout = { 5, 0 };
+    setsockopt ( fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof ( timeout ) );
+
+    return fd;
+}
+
+/**
+ * Sends the command line's request for every device to the daemon and prints the replies like the direct path does.
+ *
+ * All request lines are written at once, so the whole invocation costs a single round trip.
+ *
+ * @param fd      socket connected to the daemon
+ * @param files   HID devices
+ * @param mode    USAGE_MODE_GET, USAGE_MODE_SET, or USAGE_MODE_SETREL
+ * @param value   absolute brightness for USAGE_MODE_SET, brightness change for USAGE_MODE_SETREL
+ * @param percent     whether value is a percentage
+ * @param consistency what a brightness change waits for, one of the CONSISTENCY_ constants
+ * @param brief       only print the brightness
+ *
+ * @return The program exit status: that of the first failed device, or 0
+ */
+int forward_to_daemon ( int fd, const FileList& files, int mode, int value, bool percent, int consistency, bool brief )
+{
+    string requests;
+    char cwd[ PATH_MAX ];
+    bool have_cwd = getcwd ( cwd, sizeof ( cwd ) ) != 0;
+    const char* level = consistency == CONSISTENCY_DEFAULT ? "" : consistencyNames[ consistency ];
+
+    for ( FileList::const_iterator it = files.begin(); it != files.end(); ++it ) {
+        char command[ 64 ];
+
+        if ( mode == USAGE_MODE_SET ) {
+            snprintf ( command, sizeof ( command ), "SET %s%s%d%s ", level, *level ? " " : "", value,
+                       percent ? "%" : "" );
+        } else if ( mode == USAGE_MODE_SETREL ) {
+            snprintf ( command, sizeof ( command ), "SETREL %s%s%+d%s ", level, *level ? " " : "", value,
+                       percent ? "%" : "" );
+        } else {
+            snprintf ( command, sizeof ( command ), "GET " );
+        }
+
+        requests += command;
+
+        // The daemon does not share our working directory
+        if ( **it != '/' && !is_simulated ( *it ) && have_cwd ) {
+            requests = requests + cwd + "/";
+        }
+
+        requests = requests + *it + "\n";
+    }
+
+    if ( send ( fd, requests.data(), requests.size(), MSG_NOSIGNAL ) != ( ssize_t ) requests.size() ) {
+        perror ( "Cannot send request to the daemon" );
+
+        return 1;
+    }
+
+    string replies;
+    int exit_status = 0;
+    FileList::const_iterator it = files.begin();
+
+    while ( it != files.end() ) {
+        size_t newline = replies.find ( '\n' );
+
+        if ( newline == string::npos ) {
+            char buffer[ 512 ];
+            ssize_t length = read ( fd, buffer, sizeof ( buffer ) );
+
+            if ( length <= 0 ) {
+                fprintf ( stderr, "The daemon did not answer\n" );
+
+                return 1;
+            }
+
+            replies.append ( buffer, length );
+
+            continue;
+        }
+
+        string reply = replies.substr ( 0, newline );
+        replies.erase ( 0, newline + 1 );
+
+        if ( reply.compare ( 0, 3, "OK " ) == 0 ) {
+            if ( reports_brightness ( mode, consistency ) ) {
+                if ( !brief ) {
+                    printf ( "%s: BRIGHTNESS=", *it );
+                }
+
+                printf ( "%s\n", reply.c_str() + 3 );
+            }
+        } else {
+            char* message = 0;
+            int status = ( reply.compare ( 0, 4, "ERR " ) == 0 ) ? strtol ( reply.c_str() + 4, &message, 10 ) : 1;
+
+            fflush ( stdout );
+            fprintf ( stderr, "%s\n", message && *message ? message + 1 : reply.c_str() );
+
+            if ( !exit_status ) {
+                exit_status = status;
+            }
+        }
+
+        ++it;
+    }
+
+    return exit_status;
+}
+
+/**
+ * What the command line asks us to do with each HID device
+ */
+struct Invocation {
+    int  mode;
+    int  open_mode;
+    int  value;
+    bool percent;
+    int  consistency;
+    bool brief;
+    bool silent;
+    bool force;
+};
+
+/**
+ * The outcome of processing one HID device, kept until it can be printed in command line order
+ */
+struct DeviceResult {
+    string out;
+    string err;
+    int    status;
+    int    version;
+    bool   matched;
+
+    DeviceResult()
+        : status ( 0 )
+        , version ( -1 )
+        , matched ( false )
+    { }
+};
+
+/**
+ * Runs work(0) ... work(count - 1) on up to jobs threads.
+ *
+ * Items are handed out in order, so with a single job this is a plain loop on the calling thread.
+ *
+ * @param count number of work items
+ * @param jobs  maximum number of concurrent threads
+ * @param work  the work to do for each item
+ */
+void run_parallel ( size_t count, size_t jobs, const function<void ( size_t ) >& work )
+{
+    atomic<size_t> next ( 0 );
+    vector<thread> workers;
+
+    auto worker = [&]() {
+        for ( size_t i; ( i = next++ ) < count; ) {
+            work ( i );
+        }
+    };
+
+    jobs = min ( jobs, count );
+
+    try {
+        for ( size_t i = 1; i < jobs; ++i ) {
+            workers.push_back ( thread ( worker ) );
+        }
+    } catch ( const system_error& ) {
+        // Out of threads; whoever we did start, plus this thread, will get through the rest
+    }
+
+    worker();
+
+    for ( size_t i = 0; i < workers.size(); ++i ) {
+        workers[i].join();
+    }
+}
+
+/**
+ * Gets or sets the brightness of one HID device from the command line.
+ *
+ * Nothing is printed; the output is collected in the result instead so that devices can be processed concurrently.
+ * A failure only affects this device. If the display was opened the fast way and fails, it is opened again the long
+ * way, in case the caches are out of date, and the request is retried once.
+ *
+ * @param path       HID device path
+ * @param invocation what to do
+ * @param version    whether to read the hiddev driver version
+ *
+ * @return The outcome
+ */
+DeviceResult process_device ( const char* path, const Invocation& invocation, bool version )
+{
+    DeviceResult result;
+    Display display;
+    int status = open_display ( path, invocation.open_mode, invocation.force, display,
+                                version ? &result.version : 0 );
+
+    if ( status == PROBE_OPEN_FAILED ) {
+        result.err = probe_error ( display, status ) + "\n";
+
+        return result;
+    }
+
+    if ( status == PROBE_UNSUPPORTED || ( status == PROBE_OK && !display.device ) ) {
+        result.err = "Unsupported device:" + format_device ( display.device_info );
+    }
+
+    if ( status != PROBE_OK ) {
+        if ( status != PROBE_UNSUPPORTED ) {
+            result.err += probe_error ( display, status ) + "\n";
+        }
+
+        result.status = probe_exit_status ( status );
+
+        return result;
+    }
+
+    const char* failure = "";
+    int brightness = 0;
+
+    result.status = apply_brightness ( display, invocation.mode, invocation.value, invocation.percent,
+                                       invocation.consistency, brightness, failure );
+
+    if ( result.status != 0 && display.fast ) {
+        close_display ( display );
+
+        status = open_display ( path, invocation.open_mode, invocation.force, display, 0, false );
+
+        if ( status != PROBE_OK ) {
+            result.err = probe_error ( display, status ) + "\n";
+
+            return result;
+        }
+
+        result.status = apply_brightness ( display, invocation.mode, invocation.value, invocation.percent,
+                                           invocation.consistency, brightness, failure );
+    }
+
+    if ( result.status != 0 ) {
+        result.err += string ( failure ) + ": " + strerror ( errno ) + "\n";
+    } else if ( reports_brightness ( invocation.mode, invocation.consistency ) ) {
+        if ( !invocation.brief ) {
+            result.out = string ( path ) + ": BRIGHTNESS=";
+        }
+
+        result.out += to_string ( brightness ) + "\n";
+    }
+
+    close_display ( display );
+
+    return result;
+}
+
+/**
+ * Gets or sets the brightness of all HID devices from the command line concurrently, one thread per device, and
+ * prints the results in command line order.
+ *
+ * @param files      HID devices
+ * @param invocation what to do
+ * @param jobs       maximum number of devices to process at the same time
+ *
+ * @return The program exit status: that of the first failed device, or 0
+ */
+int process_devices ( const FileList& files, const Invocation& invocation, size_t jobs )
+{
+    vector<DeviceResult> results ( files.size() );
+    bool version_printed = invocation.silent;
+    int status = 0;
+
+    // The driver version is the same for all hiddev nodes, and only printed once
+    run_parallel ( files.size(), jobs, [&] ( size_t i ) {
+        results[i] = process_device ( files[i], invocation, !invocation.silent && i == 0 );
+    } );
+
+    for ( size_t i = 0; i < results.size(); ++i ) {
+        const DeviceResult& result = results[i];
+
+        // Unpack the 32-bit int field returned by the HIDIOCGVERSION ioctl() call
+        if ( result.version != -1 && !version_printed ) {
+            printf ( "hiddev driver version is %d.%d.%d\n",
+                     result.version >> 16, ( result.version >> 8 ) & 0xff, result.version & 0xff );
+            version_printed = true;
+        }
+
+        fflush ( stdout );
+        fputs ( result.err.c_str(), stderr );
+        fputs ( result.out.c_str(), stdout );
+
+        if ( !status ) {
+            status = result.status;
+        }
+    }
+
+    return status;
+}
+
+/**
+ * Quotes a string for JSON output
+ *
+ * @param text the string
+ *
+ * @return The string in double quotes, with quotes, backslashes and control characters escaped
+ */
+string json_string ( const string& text )
+{
+    string quoted = "\"";
+
+    for ( size_t i = 0; i < text.size(); ++i ) {
+        unsigned char c = text[i];
+
+        if ( c == '"' || c == '\\' ) {
+            quoted += '\\';
+            quoted += c;
+        } else if ( c < 0x20 ) {
+            char escaped[ 8 ];
+
+            snprintf ( escaped, sizeof ( escaped ), "\\u%04x", c );
+            quoted += escaped;
+        } else {
+            quoted += c;
+        }
+    }
+
+    return quoted + "\"";
+}
+
+/**
+ * Prints one line of --watch output. The line is flushed right away, for status bars reading from a pipe.
+ *
+ * @param path       HID device, as given in the command line
+ * @param brightness its brightness
+ * @param minimum    the lowest brightness of the display
+ * @param maximum    the highest brightness of the display
+ * @param json       print a JSON object instead of plain text
+ * @param brief      only print the brightness, for plain text
+ */
+void print_watched ( const char* path, int brightness, int minimum, int maximum, bool json, bool brief )
+{
+    long long span = maximum - minimum;
+    int percent = span > 0 ? ( int ) ( ( ( brightness - minimum ) * 100LL + span / 2 ) / span ) : 0;
+
+    if ( json ) {
+        printf ( "{\"device\":%s,\"brightness\":%d,\"percent\":%d}\n", json_string ( path ).c_str(), brightness,
+                 percent );
+    } else if ( brief ) {
+        printf ( "%d\n", brightness );
+    } else {
+        printf ( "%s: BRIGHTNESS=%d\n", path, brightness );
+    }
+
+    fflush ( stdout );
+}
+
+/**
+ * Watches the brightness of displays through the daemon: subscribes to each of them, then prints their brightness
+ * and every change the daemon tells about, until the daemon goes away.
+ *
+ * @param fd    socket connected to the daemon
+ * @param files HID devices
+ * @param json  print JSON objects instead of plain text
+ * @param brief only print the brightness, for plain text
+ *
+ * @return The program exit status: that of the first display the daemon can't watch, or 1 once the daemon is gone
+ */
+int watch_through_daemon ( int fd, const FileList& files, bool json, bool brief )
+{
+    string requests;
+    char cwd[ PATH_MAX ];
+    bool have_cwd = getcwd ( cwd, sizeof ( cwd ) ) != 0;
+    map<string, size_t> indexes;
+    vector< pair<int, int> > ranges ( files.size() );
+
+    for ( size_t i = 0; i < files.size(); ++i ) {
+        string name = files[i];
+
+        // The daemon does not share our working directory
+        if ( name[0] != '/' && !is_simulated ( files[i] ) && have_cwd ) {
+            name = string ( cwd ) + "/" + name;
+        }
+
+        indexes[ name ] = i;
+        requests += "SUBSCRIBE " + name + "\n";
+    }
+
+    if ( send ( fd, requests.data(), requests.size(), MSG_NOSIGNAL ) != ( ssize_t ) requests.size() ) {
+        perror ( "Cannot send request to the daemon" );
+
+        return 1;
+    }
+
+    string replies;
+    size_t answered = 0;
+
+    for ( ;; ) {
+        size_t newline = replies.find ( '\n' );
+
+        if ( newline == string::npos ) {
+            char buffer[ 512 ];
+            ssize_t length = read ( fd, buffer, sizeof ( buffer ) );
+
+            if ( length < 0 && errno == EINTR ) {
+                continue;
+            }
+
+            if ( length <= 0 ) {
+                fprintf ( stderr, answered < files.size() ? "The daemon did not answer\n" : "The daemon went away\n" );
+
+                return 1;
+            }
+
+            replies.append ( buffer, length );
+
+            continue;
+        }
+
+        string reply = replies.substr ( 0, newline );
+        replies.erase ( 0, newline + 1 );
+
+        // A change: "CHANGED <brightness> <device>"
+        if ( reply.compare ( 0, 8, "CHANGED " ) == 0 ) {
+            size_t space = reply.find ( ' ', 8 );
+            map<string, size_t>::const_iterator it = indexes.find ( space == string::npos ? "" :
+                    reply.substr ( space + 1 ) );
+
+            if ( it != indexes.end() && it->second < answered ) {
+                print_watched ( files[ it->second ], atoi ( reply.c_str() + 8 ), ranges[ it->second ].first,
+                                ranges[ it->second ].second, json, brief );
+            }
+
+            continue;
+        }
+
+        if ( answered == files.size() ) {
+            continue;
+        }
+
+        int brightness = 0;
+        pair<int, int>& range = ranges[ answered ];
+
+        if ( sscanf ( reply.c_str(), "OK %d %d %d", &brightness, &range.first, &range.second ) != 3 ) {
+            char* message = 0;
+            int status = ( reply.compare ( 0, 4, "ERR " ) == 0 ) ? strtol ( reply.c_str() + 4, &message, 10 ) : 1;
+
+            fprintf ( stderr, "%s\n", message && *message ? message + 1 : reply.c_str() );
+
+            return status ? status : 1;
+        }
+
+        print_watched ( files[ answered ], brightness, range.first, range.second, json, brief );
+
+        // From now on we wait for changes, however long they take
+        if ( ++answered == files.size() ) {
+            struct timeval forever = { 0, 0 };
+            setsockopt ( fd, SOL_SOCKET, SO_RCVTIMEO, &forever, sizeof ( forever ) );
+        }
+    }
+}
+
+/**
+ * A display watched directly by --watch
+ */
+struct WatchedDisplay {
+    const char* path;
+    Display     display;
+    bool        events;
+    int         brightness;
+    int         interval;
+    long long   due;
+};
+
+/**
+ * Reads the brightness of a watched display, and prints it if it changed. Unless the display reports changes as
+ * events, schedules the next read: soon after a change, and further and further apart while nothing changes.
+ *
+ * @param watched the display
+ * @param json    print JSON objects instead of plain text
+ * @param brief   only print the brightness, for plain text
+ *
+ * @return False if the brightness can't be read, with errno set
+ */
+bool refresh_watched ( WatchedDisplay& watched, bool json, bool brief )
+{
+    const char* failure = "";
+    int brightness = 0;
+
+    if ( apply_brightness ( watched.display, USAGE_MODE_GET, 0, false, CONSISTENCY_DEFAULT, brightness, failure ) ) {
+        return false;
+    }
+
+    if ( brightness != watched.brightness ) {
+        watched.brightness = brightness;
+        watched.interval = WATCH_POLL_MIN;
+
+        print_watched ( watched.path, brightness, watched.display.control.minimum, watched.display.control.maximum,
+                        json, brief );
+    } else {
+        watched.interval = min ( watched.interval * 2, WATCH_POLL_MAX );
+    }
+
+    watched.due = monotonic_ms() + watched.interval;
+
+    return true;
+}
+
+/**
+ * Watches the brightness of displays by keeping them open: prints their brightness, then every change, until they
+ * are all gone.
+ *
+ * Displays which can report brightness changes as events (see watch_brightness()) are only woken up for by the
+ * events, so watching them costs nothing while the brightness stays put. The others are read every WATCH_POLL_MIN
+ * after a change, backing off to every WATCH_POLL_MAX while nothing changes. A display which stops responding is
+ * opened again on the same schedule, e.g. after being disconnected over a suspend.
+ *
+ * @param files HID devices
+ * @param force accept devices which are not in the supported devices database
+ * @param json  print JSON objects instead of plain text
+ * @param brief only print the brightness, for plain text
+ *
+ * @return The program exit status: 1 if no display could be watched
+ */
+int watch_displays ( const FileList& files, bool force, bool json, bool brief )
+{
+    vector<WatchedDisplay> watched;
+
+    for ( size_t i = 0; i < files.size(); ++i ) {
+        WatchedDisplay display;
+        int status = open_display ( files[i], O_RDONLY, force, display.display );
+
+        if ( status == PROBE_UNSUPPORTED ) {
+            fprintf ( stderr, "Unsupported device:%s", format_device ( display.display.device_info ).c_str() );
+        }
+
+        if ( status != PROBE_OK ) {
+            if ( status != PROBE_UNSUPPORTED ) {
+                fprintf ( stderr, "%s\n", probe_error ( display.display, status ).c_str() );
+            }
+
+            continue;
+        }
+
+        display.path = files[i];
+        display.brightness = -1;
+        display.interval = WATCH_POLL_MIN;
+
+        if ( !refresh_watched ( display, json, brief ) ) {
+            fprintf ( stderr, "%s: Cannot read the brightness: %s\n", files[i], strerror ( errno ) );
+            close_display ( display.display );
+
+            continue;
+        }
+
+        display.events = watch_brightness ( display.display );
+        watched.push_back ( display );
+    }
+
+    if ( watched.empty() ) {
+        return 1;
+    }
+
+    for ( ;; ) {
+        vector<pollfd> fds;
+        vector<size_t> owners;
+        long long now = monotonic_ms();
+        long long wake = -1;
+
+        for ( size_t i = 0; i < watched.size(); ++i ) {
+            if ( watched[i].display.fd >= 0 && watched[i].events ) {
+                pollfd display_poll = { watched[i].display.fd, POLLIN, 0 };
+                fds.push_back ( display_poll );
+                owners.push_back ( i );
+            } else if ( wake < 0 || watched[i].due < wake ) {
+                wake = watched[i].due;
+            }
+        }
+
+        if ( poll ( fds.data(), fds.size(), wake < 0 ? -1 : ( int ) max ( wake - now, 0LL ) ) < 0 && errno != EINTR ) {
+            perror ( "poll" );
+
+            return 1;
+        }
+
+        for ( size_t i = 0; i < fds.size(); ++i ) {
+            WatchedDisplay& display = watched[ owners[i] ];
+            int brightness = 0;
+            int latest = -1;
+            int result = 0;
+
+            if ( !fds[i].revents ) {
+                continue;
+            }
+
+            // Only the latest of a burst of changes matters
+            while ( ( result = display.display.backend->next_event ( display.display, monotonic_ns(),
+                               brightness ) ) > 0 ) {
+                latest = brightness;
+            }
+
+            if ( latest >= 0 && latest != display.brightness ) {
+                display.brightness = latest;
+                print_watched ( display.path, latest, display.display.control.minimum,
+                                display.display.control.maximum, json, brief );
+            }
+
+            if ( result < 0 || ( fds[i].revents & ( POLLERR | POLLHUP | POLLNVAL ) ) ) {
+                close_display ( display.display );
+                display.events = false;
+                display.interval = WATCH_POLL_MIN;
+                display.due = monotonic_ms() + display.interval;
+            }
+        }
+
+        now = monotonic_ms();
+
+        for ( size_t i = 0; i < watched.size(); ++i ) {
+            WatchedDisplay& display = watched[i];
+
+            if ( ( display.display.fd >= 0 && display.events ) || display.due > now ) {
+                continue;
+            }
+
+            // Gone; try again later, less and less often
+            if ( display.display.fd < 0 &&
+                    open_display ( display.path, O_RDONLY, force, display.display ) != PROBE_OK ) {
+                display.interval = min ( display.interval * 2, WATCH_POLL_MAX );
+                display.due = now + display.interval;
+
+                continue;
+            }
+
+            if ( !refresh_watched ( display, json, brief ) ) {
+                close_display ( display.display );
+                display.due = now + display.interval;
+
+                continue;
+            }
+
+            display.events = watch_brightness ( display.display );
+        }
+    }
+}
 
-             programName );
+/**
+ * Prints how a replay compared to the trace it replayed
+ *
+ * @param trace   the replayed trace
+ * @param elapsed how long the replay took, in microseconds
+ * @param status  the exit status of the replay
+ *
+ * @return The program exit status: 1 if the replay made brightness calls which are not in the trace, otherwise that
+ *         of the replay
+ */
+int replay_summary ( const Trace& trace, long long elapsed, int status )
+{
+    fflush ( stdout );
+    fprintf ( stderr, "Replayed %ld traced calls in %lld us (recorded: %lld us); %ld traced calls were not made, "
+              "%ld brightness calls were not in the trace\n", trace.replayed.load(), elapsed, trace.elapsed,
+              trace.skipped.load(), trace.missing.load() );
+
+    return status == 0 && trace.missing ? 1 : status;
 }
 
-/** Prints brief notice about the program */
-void notice()
+/**
+ * Probes one HID device for --detect.
+ *
+ * Nothing is printed; the output is collected in the result instead so that devices can be probed concurrently.
+ *
+ * @param path  HID device path
+ * @param brief only output the path of supported USB monitors
+ *
+ * @return The outcome
+ */
+DeviceResult detect_device ( const char* path, bool brief )
 {
-    printf ( "ASDControl " VERSION " -- Apple Studio Display Brightness Control\n"
-             "Copyright (c) 2023-2024 Nicholas K. Dionysopoulos\n\n"
-           );
+    DeviceResult result;
+    ostringstream out;
+    Identity identity;
+
+    if ( is_display_name ( path ) ) {
+        result.err = string ( path ) + ": No such display\n";
+
+        return result;
+    }
+
+    if ( !probe_identity ( path, identity, &result.version ) ) {
+        result.err = string ( path ) + ": " + strerror ( errno ) + "\n";
+
+        return result;
+    }
+
+    bool monitor = identity.monitor;
+
+    result.matched = monitor && is_supported ( identity.device_info );
+
+    if ( monitor && brief ) {
+        if ( result.matched ) {
+            out << path << "\n";
+        }
+    } else if ( monitor ) {
+        out << path << ": USB Monitor - "
+            << ( result.matched ? "SUPPORTED": "UNSUPPORTED" )
+            << ".\t" << format_device ( identity.device_info, identity.serial );
+    }
+
+    result.out = out.str();
+
+    return result;
 }
 
-/** Prints detailed info about this program */
-void about()
+/**
+ * Shared state of the --detect worker threads.
+ *
+ * It is reference counted, because with --first we stop waiting for workers which are still stuck on a slow device.
+ */
+struct DetectState {
+    mutex                lock;
+    condition_variable   changed;
+    vector<DeviceResult> results;
+    size_t               next;
+    size_t               completed;
+    size_t               active;
+    long                 first_match;
+    bool                 stop;
+
+    DetectState ( size_t count )
+        : results ( count )
+        , next ( 0 )
+        , completed ( 0 )
+        , active ( 0 )
+        , first_match ( -1 )
+        , stop ( false )
+    { }
+};
+
+/**
+ * Probes the HID devices for --detect on a bounded pool of worker threads and prints the results in command line
+ * order, so that one slow device doesn't hold up all the others.
+ *
+ * With first_only, probing stops as soon as a supported USB monitor has been confirmed and only that device is
+ * printed, without waiting for devices which are still being probed.
+ *
+ * @param files      HID devices
+ * @param silent     suppress non-functional output
+ * @param brief      only output the paths of supported USB monitors
+ * @param first_only stop at the first supported USB monitor
+ * @param jobs       maximum number of devices to probe at the same time
+ *
+ * @return The program exit status; with first_only, 1 if no supported USB monitor was found
+ */
+int detect_devices ( const FileList& files, bool silent, bool brief, bool first_only, size_t jobs )
 {
-    printf ( "ASDControl " VERSION " -- Apple Studio Display Brightness Control\n"
-             "Copyright (c) 2023-2024 Nicholas K. Dionysopoulos\n\n"
+    shared_ptr<DetectState> state = make_shared<DetectState> ( files.size() );
+    unique_lock<mutex> guard ( state->lock );
 
-             "This program is free software; you can redistribute it and/or modify\n"
-             "it under the terms of the GNU General Public License as published by\n"
-             "the Free Software Foundation; either version 2 of the License, or\n"
-             "(at your option) any later version.\n\n"
+    auto worker = [state, files, brief, first_only]() {
+        unique_lock<mutex> guard ( state->lock );
 
-             "This program is distributed in the hope that it will be useful,\n"
-             "but WITHOUT ANY WARRANTY; without even the implied warranty of\n"
-             "MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the\n"
-             "GNU General Public License for more details.\n\n"
+        while ( !state->stop && state->next < files.size() ) {
+            size_t i = state->next++;
 
-             "You should have received a copy of the GNU General Public License\n"
-             "along with this program; if not, write to the Free Software\n"
-             "Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA\n\n"
+            guard.unlock();
+            DeviceResult result = detect_device ( files[i], brief );
+            guard.lock();
 
-             "CREDITS:\n"
-             "  Based on acdcontrol, written by Pavel Gurevich.\n\n"
-           );
+            state->results[i] = result;
+            ++state->completed;
+
+            if ( result.matched && ( state->first_match < 0 || ( long ) i < state->first_match ) ) {
+                state->first_match = i;
+                state->stop = first_only;
+            }
+
+            state->changed.notify_all();
+        }
+
+        --state->active;
+        state->changed.notify_all();
+    };
+
+    for ( size_t i = 0; i < min ( jobs, files.size() ); ++i ) {
+        try {
+            thread ( worker ).detach();
+            ++state->active;
+        } catch ( const system_error& ) {
+            break;
+        }
+    }
+
+    if ( !state->active ) {
+        ++state->active;
+        guard.unlock();
+        worker();
+        guard.lock();
+    }
+
+    state->changed.wait ( guard, [state, first_only]() {
+        return ( first_only && state->first_match >= 0 ) || !state->active;
+    } );
+
+    bool version_printed = silent;
+    int status = 0;
+
+    for ( size_t i = 0; i < state->results.size(); ++i ) {
+        const DeviceResult& result = state->results[i];
+
+        if ( first_only && ( long ) i != state->first_match ) {
+            continue;
+        }
+
+        // Unpack the 32-bit int field returned by the HIDIOCGVERSION ioctl() call
+        if ( result.version != -1 && !version_printed ) {
+            printf ( "hiddev driver version is %d.%d.%d\n",
+                     result.version >> 16, ( result.version >> 8 ) & 0xff, result.version & 0xff );
+            version_printed = true;
+        }
+
+        fflush ( stdout );
+        fputs ( result.err.c_str(), stderr );
+        fputs ( result.out.c_str(), stdout );
+    }
+
+    if ( first_only && state->first_match < 0 ) {
+        status = 1;
+    }
+
+    bool stragglers = state->active > 0;
+
+    guard.unlock();
+    save_detection_cache();
+
+    // Don't wait for, nor tear down the program under, workers still blocked on an unresponsive device
+    if ( stragglers ) {
+        fflush ( stdout );
+        _exit ( status );
+    }
+
+    return status;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -403,18 +5948,11 @@ void about()
 ////////////////////////////////////////////////////////////////////////////////
 int main ( int argc, char **argv )
 {
-    int fd = -1;
     int rd, i;
     int alv, yalv;
-    struct hiddev_devinfo device_info;
-    struct hiddev_report_info rep_info;
     struct hiddev_field_info field_info;
-    struct hiddev_usage_ref usage_ref;
-    struct hiddev_event ev[64];
-    fd_set fdset;
     int report_type;
     int appl;
-    int version;
     int brightness = 0;
     int amount = 0;
     int mode = USAGE_MODE_GET;
@@ -424,17 +5962,29 @@ int main ( int argc, char **argv )
     bool brief  = false;
     bool silent = false;
     bool force = false;
-
-    bool first_device=true;
+    bool use_daemon = true;
+    bool auto_detect = false;
+    bool use_cache = true;
+    bool first_only = false;
+    bool json = false;
+    int consistency = CONSISTENCY_DEFAULT;
 
     bool percent=false;
 
     int c;
     int digit_optind = 0;
 
-    const DeviceId* selected_device = 0;
-
-    init_device_database();
+    string socket_path;
+    int idle_timeout = 0;
+    bool hotplug = false;
+    bool wait_device = false;
+    int wait_timeout = -1;
+    vector<string> expanded;
+    string uevent_standin;
+    vector<string> enumerated;
+    const char* record_path = 0;
+    const char* replay_path = 0;
+    vector<string> replayed;
 
     while ( 1 ) {
         int this_option_optind = optind ? optind : 1;
@@ -447,6 +5997,24 @@ int main ( int argc, char **argv )
             {"force", 0, 0, 'f'},
             {"detect", 0, 0, 'd'},
             {"list-all", 0, 0, 'l'},
+            {"daemon", 0, 0, 'D'},
+            {"socket", 1, 0, 'S'},
+            {"no-daemon", 0, 0, 'N'},
+            {"idle-timeout", 1, 0, 'I'},
+            {"auto", 0, 0, 'A'},
+            {"sysfs-root", 1, 0, 'R'},
+            {"no-cache", 0, 0, 'C'},
+            {"first", 0, 0, 'F'},
+            {"hotplug", 0, 0, 'H'},
+            {"uevent-socket", 1, 0, 'U'},
+            {"wait-for-device", 2, 0, 'W'},
+            {"backend", 1, 0, 'B'},
+            {"usage-ioctls", 1, 0, 'M'},
+            {"consistency", 1, 0, 'K'},
+            {"watch", 2, 0, 'w'},
+            {"fake-usbfs", 2, 0, 'X'},
+            {"record", 1, 0, 'T'},
+            {"replay", 1, 0, 'P'},
             {0, 0, 0, 0}
         };
 
@@ -486,6 +6054,111 @@ int main ( int argc, char **argv )
             dump_supported();
             exit ( 0 );
 
+        case 'D':
+            mode=USAGE_MODE_DAEMON;
+            break;
+
+        case 'S':
+            socket_path=optarg;
+            break;
+
+        case 'N':
+            use_daemon=false;
+            break;
+
+        case 'I':
+            idle_timeout=atoi ( optarg );
+            break;
+
+        case 'A':
+            auto_detect=true;
+            break;
+
+        case 'R':
+            sysfsRoot=optarg;
+            break;
+
+        case 'C':
+            use_cache=false;
+            break;
+
+        case 'F':
+            first_only=true;
+            break;
+
+        case 'H':
+            hotplug=true;
+            break;
+
+        case 'U':
+            hotplug=true;
+            uevent_standin=optarg;
+            break;
+
+        case 'W':
+            wait_device=true;
+            wait_timeout=optarg ? ( int ) ( atof ( optarg ) * 1000 ) : -1;
+            break;
+
+        case 'B':
+            if ( strcmp ( optarg, "hiddev" ) == 0 ) {
+                deviceBackend = BACKEND_HIDDEV;
+            } else if ( strcmp ( optarg, "hidraw" ) == 0 ) {
+                deviceBackend = BACKEND_HIDRAW;
+            } else if ( strcmp ( optarg, "usbfs" ) == 0 ) {
+                deviceBackend = BACKEND_USBFS;
+            } else {
+                fprintf ( stderr, "Unknown backend '%s'\n", optarg );
+                exit ( 2 );
+            }
+            break;
+
+        case 'M':
+            if ( strcmp ( optarg, "auto" ) == 0 ) {
+                usageIoctls = USAGE_IOCTLS_AUTO;
+            } else if ( strcmp ( optarg, "single" ) == 0 ) {
+                usageIoctls = USAGE_IOCTLS_SINGLE;
+            } else if ( strcmp ( optarg, "multi" ) == 0 ) {
+                usageIoctls = USAGE_IOCTLS_MULTI;
+            } else {
+                fprintf ( stderr, "Unknown usage ioctls '%s'\n", optarg );
+                exit ( 2 );
+            }
+            break;
+
+        case 'K':
+            if ( !parse_consistency ( optarg, consistency ) ) {
+                fprintf ( stderr, "Unknown consistency level '%s'\n", optarg );
+                exit ( 2 );
+            }
+            break;
+
+        case 'w':
+            mode=USAGE_MODE_WATCH;
+
+            if ( optarg && strcmp ( optarg, "json" ) == 0 ) {
+                json = true;
+            } else if ( optarg && strcmp ( optarg, "plain" ) != 0 ) {
+                fprintf ( stderr, "Unknown watch format '%s'\n", optarg );
+                exit ( 2 );
+            }
+            break;
+
+        case 'X':
+            usbfs = &fakeUsbfs;
+            fakeUsbfs.state_path = optarg ? optarg : "";
+            use_cache = false;
+            break;
+
+        case 'T':
+            record_path = optarg;
+            use_daemon = false;
+            break;
+
+        case 'P':
+            replay_path = optarg;
+            break;
+
         default:
             fprintf ( stderr,"Unknown option '%c'\n", c );
             help ( argv[0] );
@@ -493,11 +6166,15 @@ int main ( int argc, char **argv )
         }
     }
 
-    typedef list< const char* > FileList;
     FileList files;
 
     for ( int param = optind; param < argc; ++param ) {
-        if ( mode != USAGE_MODE_DETECT && number ( argv[ param ] ) ) {
+        if ( mode == USAGE_MODE_WATCH && number ( argv[ param ] ) ) {
+            fprintf ( stderr, "--watch can't change the brightness\n" );
+            exit ( 2 );
+        }
+
+        if ( mode != USAGE_MODE_DETECT && mode != USAGE_MODE_DAEMON && number ( argv[ param ] ) ) {
             if ( argv[ param ][0] == '+' || argv[ param ][0] == '-' ) {
                 mode = USAGE_MODE_SETREL;
                 amount = atoi ( argv[ param ] );
@@ -514,176 +6191,183 @@ int main ( int argc, char **argv )
         files.push_back ( argv[ param ] );
     }
 
-    if ( files.empty() ) {
-        help ( argv[0] );
-        exit ( 1 );
-    }
+    // A replay repeats the recorded invocation, with simulated displays standing in for the recorded ones
+    if ( replay_path ) {
+        if ( !load_trace ( replay_path, replayTrace ) ) {
+            perror ( replay_path );
+            exit ( 1 );
+        }
 
-    if ( mode == USAGE_MODE_SET || mode == USAGE_MODE_SETREL ) {
-        open_mode = O_RDWR;
+        mode = replayTrace.header.mode;
+        brightness = amount = replayTrace.header.value;
+        percent = replayTrace.header.percent;
+        force = replayTrace.header.force;
+        consistency = replayTrace.header.consistency;
+        use_cache = false;
+        use_daemon = false;
+        auto_detect = false;
+        files.clear();
+
+        for ( size_t i = 0; i < replayTrace.displays.size(); ++i ) {
+            Product product = traced_product ( replayTrace.displays[i] );
+            ostringstream name;
+
+            // Other HID devices which happened to be in the command line
+            if ( product && product != STUDIO_DISPLAY_27 && product != PRO_XDR_DISPLAY_32 ) {
+                continue;
+            }
+
+            name << "sim:" << ( product == PRO_XDR_DISPLAY_32 ? "xdr" : "studio" ) << ",trace=" << i;
+            replayed.push_back ( name.str() );
+        }
+
+        for ( size_t i = 0; i < replayed.size(); ++i ) {
+            files.push_back ( replayed[i].c_str() );
+        }
+
+        if ( files.empty() || ( mode != USAGE_MODE_GET && mode != USAGE_MODE_SET && mode != USAGE_MODE_SETREL ) ) {
+            fprintf ( stderr, "%s: Nothing to replay\n", replay_path );
+            exit ( 1 );
+        }
     }
 
-    if ( !silent ) {
-        notice();
+    if ( use_cache ) {
+        load_detection_cache();
     }
 
-    for ( FileList::iterator it = files.begin(); it != files.end(); ++it ) {
-        if ( ( fd = open ( *it, open_mode ) ) < 0 ) {
-            perror ( *it );
-            continue;
+    if ( wait_device && mode != USAGE_MODE_DETECT && mode != USAGE_MODE_DAEMON && ( !files.empty() || auto_detect ) ) {
+        if ( !wait_for_device ( files, auto_detect, sysfsRoot, wait_timeout ) ) {
+            fprintf ( stderr, "Timed out waiting for a supported Apple Display\n" );
+            exit ( 1 );
         }
+    }
 
-        /* ioctl() accesses the underlying driver */
-        ioctl ( fd, HIDIOCGVERSION, &version );
+    // Expand patterns left over by the shell and resolve display names
+    expanded = expand_devices ( files );
+    files.clear();
 
-        // Unpack the 32-bit int field returned by the HIDIOCGVERSION ioctl() call
-        if ( ! silent && first_device )
-            printf ( "hiddev driver version is %d.%d.%d\n",
-                     version >> 16, ( version >> 8 ) & 0xff, version & 0xff );
+    for ( size_t i = 0; i < expanded.size(); ++i ) {
+        files.push_back ( expanded[i].c_str() );
+    }
 
-        // Get the device information
-        ioctl ( fd, HIDIOCGDEVINFO, &device_info );
+    if ( auto_detect ) {
+        enumerated = enumerate_displays ( sysfsRoot );
 
-        if ( mode == USAGE_MODE_DETECT ) {
-            if ( is_usb_monitor ( device_info, fd ) ) {
-                cout << *it << ": USB Monitor - "
-                     << ( is_supported ( device_info ) ? "SUPPORTED": "UNSUPPORTED" )
-                     << ".\t";
-                format_device ( cout, device_info );
-            }
+        for ( size_t i = 0; i < enumerated.size(); ++i ) {
+            files.push_back ( enumerated[i].c_str() );
+        }
+    }
 
-            continue;
+    if ( mode == USAGE_MODE_DAEMON ) {
+        if ( !silent ) {
+            notice();
         }
 
-        if ( not ( selected_device = is_supported ( device_info ) ) ) {
-            cerr << "Unsupported device:";
+        DaemonOptions options;
 
-            format_device ( cerr, device_info );
+        options.socket_path = socket_path.empty() ? default_socket_path() : socket_path;
+        options.idle_timeout = idle_timeout;
+        options.silent = silent;
+        options.hotplug = hotplug;
+        options.uevent_socket = uevent_standin;
 
-            if ( !force ) {
-                exit ( 2 );
-            }
+        if ( record_path && !start_recording ( record_path, mode, 0, false, false, CONSISTENCY_DEFAULT ) ) {
+            perror ( record_path );
+            exit ( 1 );
         }
 
+        flush_recording();
 
-        if ( ! is_usb_monitor ( device_info, fd ) ) {
-            cerr << *it << ": This device is not a USB monitor!" << endl;
+        int status = run_daemon ( options, files );
 
-            continue;
-        }
+        stop_recording();
 
-        /* Initialise the internal report structures */
-        if ( ioctl ( fd, HIDIOCINITREPORT,0 ) < 0 ) {
-            cerr << "FATAL: Failed to initialize internal report structures"
-                 << endl;
+        return status;
+    }
 
-            exit ( 1 );
-        }
+    if ( files.empty() && auto_detect ) {
+        fprintf ( stderr, "No supported Apple Display found\n" );
+        exit ( 1 );
+    }
 
-        if (percent)
-        {
-          int span = selected_device->brightness_max - selected_device->brightness_min;
+    if ( files.empty() ) {
+        help ( argv[0] );
+        exit ( 1 );
+    }
 
-          if (amount == 0)
-          {
-            brightness = (min(max(brightness, 0), 100) * span / 100) + selected_device->brightness_min;
-          }
-          else
-          {
-            amount = amount * span / 100;
-          }
-        }
+    if ( mode == USAGE_MODE_SET || mode == USAGE_MODE_SETREL ) {
+        open_mode = O_RDWR;
+    }
 
-        usage_ref.report_type = HID_REPORT_TYPE_FEATURE;
-        usage_ref.report_id = BRIGHTNESS_CONTROL;
-        usage_ref.field_index = 0;
-        usage_ref.usage_index = 0;
-        usage_ref.usage_code = USAGE_CODE;
-        usage_ref.value = brightness;
+    if ( !silent ) {
+        notice();
+    }
 
-        rep_info.report_type = HID_REPORT_TYPE_FEATURE;
-        rep_info.report_id = BRIGHTNESS_CONTROL;
-        rep_info.num_fields = 1;
+    /* Hand the request over to the control daemon if one is running; otherwise fall through to the direct path */
+    if ( use_daemon && mode != USAGE_MODE_DETECT && !force ) {
+        int daemon = connect_daemon ( socket_path.empty() ? default_socket_path() : socket_path );
 
-        if ( mode == USAGE_MODE_SET ) {
-            if ( ioctl ( fd, HIDIOCSUSAGE, &usage_ref ) < 0 ) {
-                perror ( "Cannot set brightness" );
-                exit ( 2 );
-            }
+        if ( daemon >= 0 && mode == USAGE_MODE_WATCH ) {
+            int status = watch_through_daemon ( daemon, files, json, brief );
 
-            if ( ioctl ( fd, HIDIOCSREPORT, &rep_info ) < 0 ) {
-                perror ( "Cannot read brightness" );
-                exit ( 3 );
-            }
-        } else {
-            if ( ioctl ( fd, HIDIOCGUSAGE, &usage_ref ) < 0 ) {
-                perror ( "Cannot ask monitor for brightness control" );
-                exit ( 2 );
-            }
+            close ( daemon );
 
-            if ( ioctl ( fd, HIDIOCGREPORT, &rep_info ) < 0 ) {
-                perror ( "Cannot read brightness" );
-                exit ( 3 );
-            }
+            return status;
+        }
 
-            if ( mode == USAGE_MODE_SETREL ) {
-                brightness = usage_ref.value + amount;
-                brightness = max ( selected_device->brightness_min, brightness );
-                brightness = min ( selected_device->brightness_max, brightness );
-                usage_ref.value = brightness;
+        if ( daemon >= 0 ) {
+            int status = forward_to_daemon ( daemon, files, mode, mode == USAGE_MODE_SET ? brightness : amount,
+                                             percent, consistency, brief );
 
-                /* set calculated brightness */
-                if ( ioctl ( fd, HIDIOCSUSAGE, &usage_ref ) < 0 ) {
-                    perror ( "Cannot set brightness" );
-                    exit ( 2 );
-                }
+            close ( daemon );
 
-                if ( ioctl ( fd, HIDIOCSREPORT, &rep_info ) < 0 ) {
-                    perror ( "Cannot read brightness" );
-                    exit ( 3 );
-                }
+            return status;
+        }
+    }
 
-                /* read brightness back from device */
-                if ( ioctl ( fd, HIDIOCGUSAGE, &usage_ref ) < 0 ) {
-                    perror ( "Cannot ask monitor for brightness control" );
-                    exit ( 2 );
-                }
+    if ( mode == USAGE_MODE_WATCH ) {
+        return watch_displays ( files, force, json, brief );
+    }
 
-                if ( ioctl ( fd, HIDIOCGREPORT, &rep_info ) < 0 ) {
-                    perror ( "Cannot read brightness" );
-                    exit ( 3 );
-                }
-            }
+    if ( mode != USAGE_MODE_DETECT ) {
+        Invocation invocation;
 
-            if ( !brief ) {
-                cout << *it << ": BRIGHTNESS=";
-            }
+        invocation.mode = mode;
+        invocation.open_mode = open_mode;
+        invocation.value = ( mode == USAGE_MODE_SET ) ? brightness : amount;
+        invocation.percent = percent;
+        invocation.consistency = consistency;
+        invocation.brief = brief;
+        invocation.silent = silent;
+        invocation.force = force;
 
-            cout << usage_ref.value << endl;
+        if ( record_path && !start_recording ( record_path, mode, invocation.value, percent, force, consistency ) ) {
+            perror ( record_path );
+            exit ( 1 );
         }
 
-        close ( fd );
-        first_device=false;
-    }
-}
+        long long start = monotonic_ns();
+        int status = process_devices ( files, invocation, DETECT_JOBS );
 
+        stop_recording();
+        save_detection_cache();
 
-void init_device_database()
-{
-    supportedVendors.insert ( VendorDesc ( APPLE, "Apple" ) );
+        if ( replay_path ) {
+            status = replay_summary ( replayTrace, ( monotonic_ns() - start ) / 1000, status );
+        }
 
-    supportedDevices.insert ( DeviceId ( APPLE, PRO_XDR_DISPLAY_32,
-                                         "Apple Pro XDR Display (2019, 32\")", 400, 60000 ) );
+        return status;
+    }
 
-    supportedDevices.insert ( DeviceId ( APPLE, STUDIO_DISPLAY_27,
-                                         "Apple Studio Display (2022, 27\")", 400, 60000 ) );
+    return detect_devices ( files, silent, brief, first_only, DETECT_JOBS );
 }
 
 void dump_supported ()
 {
-    for ( SupportedDevices::iterator it = supportedDevices.begin(); it != supportedDevices.end(); ++ it )
-        cout << "Vendor=" << setw ( 6 ) << hex << showbase << it->vendor
-             << " (" << supportedVendors[ it->vendor ] << "), "
-             << "Product=" << it->product << " ["
-             << it->description << "]" << endl;
+    for ( size_t i = 0; i < sizeof ( supportedDevices ) / sizeof ( supportedDevices[0] ); ++i ) {
+        const DeviceId& device = supportedDevices[i];
+
+        printf ( "Vendor=%#6x (%s), Product=%#x [%s]\n", device.vendor, vendor_name ( device.vendor ), device.product,
+                 device.description );
+    }
 }
@@ -0,0 +1,72 @@
+#!/bin/bash
+#
+# Measures what each consistency level costs: the latency of setting the brightness and of changing it relatively
+# with --consistency=fire-and-forget, readback and event, and the calls to the display each of them makes.
+#
+# Usage: bench/consistency.sh [iterations] [display]
+#
+# The display defaults to a simulated one whose ioctls take LATENCY microseconds (default: 500), and which reports
+# brightness changes as events after the same time. hiddev and hidraw nodes work too. Set ASDCONTROL to the binary
+# under test (default: ./asdcontrol). Needs bash 5 for its clock.
+#
+# The output is tab separated, with a header line, one line per consistency level and operation:
+#   consistency  fire-and-forget, readback or event
+#   operation    set or setrel
+#   calls        calls to the display per invocation: open, close, ioctls and waits for events
+#   brightness   brightness ioctls (usage and report) per invocation
+#   events       waits for an event per invocation, and how many of them timed out
+#   p50_us p90_us p99_us max_us
+#                latency percentiles of the whole invocation in microseconds
+
+ASDCONTROL=${ASDCONTROL:-./asdcontrol}
+LATENCY=${LATENCY:-500}
+ITERATIONS=${1:-500}
+DISPLAY_=${2:-sim:studio,latency=$LATENCY}
+
+. "$(dirname "$0")/lib.sh"
+
+if [ -z "$EPOCHREALTIME" ]; then
+    echo "$0 needs bash 5 or later" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/asdcontrol-consistency.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+COUNTS='
+    $4 == gusage || $4 == susage || $4 == gusages || $4 == susages { ++brightness }
+    $4 == greport || $4 == sreport { ++brightness }
+    $4 == event { ++events; if ($7 != 0) ++timeouts }
+    END { printf "%.1f\t%.1f (%d timed out)", brightness / n, events / n, timeouts }
+'
+
+# Runs one operation
+#
+# $1 the consistency level
+# $2 the name of the operation
+# $3 the brightness argument
+benchmark() {
+    : > "$WORK/wall"
+    : > "$WORK/calls"
+
+    for ((i = 0; i < ITERATIONS; ++i)); do
+        start=${EPOCHREALTIME/[.,]/}
+        "$ASDCONTROL" --silent --brief --no-daemon --consistency="$1" --record="$WORK/trace" "$DISPLAY_" $3 > /dev/null ||
+            exit 1
+        end=${EPOCHREALTIME/[.,]/}
+        echo $((end - start)) >> "$WORK/wall"
+
+        trace_records "$WORK/trace" >> "$WORK/calls"
+    done
+
+    printf "%s\t%s\t%s\t%s\t%s\n" "$1" "$2" \
+        "$(awk -v n="$ITERATIONS" 'END { printf "%.1f", NR / n }' "$WORK/calls")" \
+        "$(awk $TRACE_REQUESTS -v n="$ITERATIONS" "$COUNTS" "$WORK/calls")" "$(percentiles < "$WORK/wall")"
+}
+
+printf "consistency\toperation\tcalls\tbrightness\tevents\tp50_us\tp90_us\tp99_us\tmax_us\n"
+
+for CONSISTENCY in fire-and-forget readback event; do
+    benchmark $CONSISTENCY set 30000
+    benchmark $CONSISTENCY setrel +100
+done
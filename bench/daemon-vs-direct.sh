@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Compares the per-invocation latency of the direct ioctl path against forwarding the same request to a running
+# control daemon.
+#
+# Usage: bench/daemon-vs-direct.sh <hid device> [iterations] [brightness]
+#
+# Set ASDCONTROL to the binary under test (default: ./asdcontrol). The brightness argument is passed verbatim, e.g.
+# +0 to benchmark a relative change which does not actually alter the brightness. Without it, the brightness is read.
+
+ASDCONTROL=${ASDCONTROL:-./asdcontrol}
+DEVICE=$1
+ITERATIONS=${2:-200}
+BRIGHTNESS=$3
+
+. "$(dirname "$0")/lib.sh"
+
+if [ -z "$DEVICE" ]; then
+    echo "Usage: $0 <hid device> [iterations] [brightness]" >&2
+    exit 1
+fi
+
+SOCKET=$(mktemp -u "${TMPDIR:-/tmp}/asdcontrol-bench.XXXXXX")
+
+"$ASDCONTROL" --silent --daemon --socket="$SOCKET" "$DEVICE" &
+DAEMON=$!
+trap 'kill $DAEMON 2>/dev/null' EXIT
+
+while [ ! -S "$SOCKET" ]; do
+    kill -0 $DAEMON 2>/dev/null || exit 1
+    sleep 0.05
+done
+
+DIRECT=$(run "$ASDCONTROL" --silent --brief --no-daemon "$DEVICE" $BRIGHTNESS)
+FORWARDED=$(run "$ASDCONTROL" --silent --brief --socket="$SOCKET" "$DEVICE" $BRIGHTNESS)
+
+echo "path       iterations  us/invocation"
+echo "direct     $ITERATIONS  $DIRECT"
+echo "daemon     $ITERATIONS  $FORWARDED"
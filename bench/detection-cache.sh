@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# Compares cold detection (every HID device is opened and probed) against warm detection (the detection cache is
+# valid, so only a stat() per device node is needed).
+#
+# Usage: bench/detection-cache.sh [iterations] [hid devices...]
+#
+# Set ASDCONTROL to the binary under test (default: ./asdcontrol). The HID devices default to /dev/usb/hiddev* or
+# /dev/hiddev*. A temporary cache directory is used, so your own cache is left alone.
+
+ASDCONTROL=${ASDCONTROL:-./asdcontrol}
+ITERATIONS=${1:-100}
+[ $# -gt 0 ] && shift
+
+. "$(dirname "$0")/lib.sh"
+
+if [ $# -eq 0 ]; then
+    set -- /dev/usb/hiddev* /dev/hiddev*
+fi
+
+XDG_RUNTIME_DIR=$(mktemp -d "${TMPDIR:-/tmp}/asdcontrol-bench.XXXXXX")
+export XDG_RUNTIME_DIR
+trap 'rm -rf "$XDG_RUNTIME_DIR"' EXIT
+
+# Detects the displays; not finding any is fine
+detect() {
+    "$ASDCONTROL" --silent --detect "$@" 2> /dev/null || true
+}
+
+COLD=$(run detect --no-cache "$@")
+
+# Prime the cache
+"$ASDCONTROL" --silent --detect "$@" > /dev/null 2>&1
+WARM=$(run detect "$@")
+
+echo "detection  iterations  us/invocation"
+echo "cold       $ITERATIONS  $COLD"
+echo "warm       $ITERATIONS  $WARM"
@@ -0,0 +1,73 @@
+#!/bin/bash
+#
+# Compares the full probe of a hiddev display with the fast path taken when the display is already in the detection
+# cache: the calls to the display and the system calls of one invocation, and the latency of getting and setting the
+# brightness.
+#
+# Usage: bench/fast-path.sh <hiddev node> [iterations]
+#
+# Displays made with tools/fake-hiddev work as well as real ones. Set ASDCONTROL to the binary under test (default:
+# ./asdcontrol). Needs bash 5 for its clock.
+#
+# The output is tab separated, with a header line, one line per path and operation:
+#   path        full (--no-cache) or fast
+#   operation   get or set
+#   calls       calls to the display per invocation: open, close and ioctls
+#   initreport  HIDIOCINITREPORT calls per invocation
+#   syscalls    system calls per invocation, if strace is installed
+#   p50_us p90_us p99_us max_us
+#               latency percentiles of the whole invocation in microseconds
+
+ASDCONTROL=${ASDCONTROL:-./asdcontrol}
+DEVICE=$1
+ITERATIONS=${2:-500}
+
+. "$(dirname "$0")/lib.sh"
+
+if [ -z "$DEVICE" ]; then
+    echo "Usage: $0 <hiddev node> [iterations]" >&2
+    exit 1
+fi
+
+if [ -z "$EPOCHREALTIME" ]; then
+    echo "$0 needs bash 5 or later" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/asdcontrol-fast-path.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+# Runs one operation along one path
+#
+# $1 the name of the path
+# $2 the name of the operation
+# $3 the options selecting the path
+# $4 the brightness argument, if any
+benchmark() {
+    : > "$WORK/wall"
+    : > "$WORK/calls"
+
+    # Make sure the detection cache knows the display, so only --no-cache takes the full path
+    "$ASDCONTROL" --silent --no-daemon "$DEVICE" > /dev/null || exit 1
+
+    for ((i = 0; i < ITERATIONS; ++i)); do
+        start=${EPOCHREALTIME/[.,]/}
+        "$ASDCONTROL" --silent --brief --no-daemon $3 --record="$WORK/trace" "$DEVICE" $4 > /dev/null || exit 1
+        end=${EPOCHREALTIME/[.,]/}
+        echo $((end - start)) >> "$WORK/wall"
+
+        trace_records "$WORK/trace" | awk '{ print $4 }' >> "$WORK/calls"
+    done
+
+    printf "%s\t%s\t%s\t%s\t%s\t%s\n" "$1" "$2" \
+        "$(awk -v n="$ITERATIONS" 'END { printf "%.1f", NR / n }' "$WORK/calls")" \
+        "$(awk $TRACE_REQUESTS -v n="$ITERATIONS" '$1 == initreport { ++count } END { printf "%.1f", count / n }' "$WORK/calls")" \
+        "$(syscalls "$ASDCONTROL" --silent --brief --no-daemon $3 "$DEVICE" $4)" "$(percentiles < "$WORK/wall")"
+}
+
+printf "path\toperation\tcalls\tinitreport\tsyscalls\tp50_us\tp90_us\tp99_us\tmax_us\n"
+
+benchmark full get --no-cache
+benchmark fast get
+benchmark full set --no-cache +0
+benchmark fast set "" +0
@@ -0,0 +1,119 @@
+#!/bin/sh
+#
+# Runs asdcontrol against a display made slow or flaky by the ioctl-inject preload library, and reports how each
+# scenario ends: the exit statuses, whether the other displays still answered, the wall clock time per invocation and
+# the latency of the ioctl() calls to the faulty display.
+#
+# Usage: bench/fault-injection.sh <hiddev node>...
+#
+# The first display is the faulty one; faults are only injected into its calls, and every other display must keep
+# answering in every scenario. Displays made with tools/fake-hiddev work as well as real ones.
+#
+# Environment:
+#   ASDCONTROL  the binary under test (default: ./asdcontrol); it is used as built, without changes
+#   INJECT      the preload library (default: tools/ioctl-inject.so, built with "make ioctl-inject")
+#   ITERATIONS  invocations per scenario (default: 100)
+#   RATE        probability of a fault per call (default: 0.1)
+#   DELAY       latency of the slow scenario, in microseconds (default: 20000)
+#   HANG        length of a hang, in milliseconds (default: 2000)
+#   TIMEOUT     invocations taking longer than this many seconds are killed and count as hung (default: 10)
+#   BRIGHTNESS  passed verbatim, e.g. +0 to exercise the set path without changing the brightness; the default reads
+
+ASDCONTROL=${ASDCONTROL:-./asdcontrol}
+INJECT=${INJECT:-tools/ioctl-inject.so}
+ITERATIONS=${ITERATIONS:-100}
+RATE=${RATE:-0.1}
+DELAY=${DELAY:-20000}
+HANG=${HANG:-2000}
+TIMEOUT=${TIMEOUT:-10}
+
+. "$(dirname "$0")/lib.sh"
+
+if [ $# -eq 0 ]; then
+    echo "Usage: $0 <hiddev node>..." >&2
+    exit 1
+fi
+
+if [ ! -f "$INJECT" ]; then
+    echo "$INJECT not found; run make ioctl-inject" >&2
+    exit 1
+fi
+
+INJECT=$(realpath "$INJECT")
+FAULTY=$1
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/asdcontrol-faults.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+# Prints the percentiles of a file of numbers, one per line, space separated
+#
+# $1 the file
+spread() {
+    percentiles < "$1" | tr '\t' ' '
+}
+
+# Runs one scenario
+#
+# $1 the name of the scenario
+# $2 the settings of the preload library, e.g. "INJECT_ERRORS=EIO:0.1"
+# $@ the displays
+scenario() {
+    name=$1
+    settings=$2
+    shift 2
+
+    : > "$WORK/log"
+    : > "$WORK/wall"
+    : > "$WORK/status"
+    expected=0
+    answered=0
+    i=0
+
+    while [ $i -lt "$ITERATIONS" ]; do
+        start=$(date +%s%N)
+        # shellcheck disable=SC2086
+        env LD_PRELOAD="$INJECT" INJECT_PATHS="$FAULTY" INJECT_LOG="$WORK/log" INJECT_SEED=$i $settings \
+            timeout "$TIMEOUT" "$ASDCONTROL" --silent --no-daemon --no-cache "$@" $BRIGHTNESS \
+            > "$WORK/out" 2> /dev/null
+        echo $? >> "$WORK/status"
+        end=$(date +%s%N)
+        echo $(( (end - start) / 1000 )) >> "$WORK/wall"
+
+        # Every display but the faulty one must have answered
+        for DEVICE in "$@"; do
+            if [ "$DEVICE" != "$FAULTY" ]; then
+                expected=$((expected + 1))
+                grep -q "^$DEVICE: BRIGHTNESS=" "$WORK/out" && answered=$((answered + 1))
+            fi
+        done
+
+        i=$((i + 1))
+    done
+
+    statuses=$(sort -n "$WORK/status" | uniq -c |
+        awk '{ printf "%s%s:%s", separator, ($2 == 124 ? "hung" : $2), $1; separator = "," }')
+    awk '$3 == "ioctl" { print $8 }' "$WORK/log" > "$WORK/ioctl"
+
+    if [ $answered -eq $expected ]; then
+        others="ok"
+    else
+        others="DEGRADED $answered/$expected"
+    fi
+
+    printf "%-10s %-24s %-16s %-30s %s\n" "$name" "$statuses" "$others" "$(spread "$WORK/wall")" \
+        "$(spread "$WORK/ioctl")"
+}
+
+echo "Faulty display: $FAULTY; $ITERATIONS invocations per scenario; $(($# - 1)) other display(s)"
+echo
+printf "%-10s %-24s %-16s %-30s %s\n" "scenario" "exit status:count" "other displays" \
+    "us/invocation p50 p90 p99 max" "us/ioctl p50 p90 p99 max"
+
+scenario baseline "" "$@"
+scenario slow "INJECT_DELAY=$DELAY INJECT_JITTER=$((DELAY / 2))" "$@"
+scenario eio "INJECT_ERRORS=EIO:$RATE" "$@"
+scenario eagain "INJECT_ERRORS=EAGAIN:$RATE" "$@"
+scenario enodev "INJECT_ERRORS=ENODEV:$RATE" "$@"
+scenario open "INJECT_OPEN_ERRORS=ENODEV:$RATE" "$@"
+scenario hang "INJECT_HANG=$RATE INJECT_HANG_TIME=$HANG" "$@"
+scenario unplug "INJECT_ERRORS=ENODEV:1
+    INJECT_IOCTLS=HIDIOCGUSAGE,HIDIOCSUSAGE,HIDIOCGUSAGES,HIDIOCSUSAGES,HIDIOCGREPORT,HIDIOCSREPORT" "$@"
@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Compares the hiddev and hidraw paths to the same display: the number of system calls and the wall clock time per
+# invocation.
+#
+# Usage: bench/hidraw-vs-hiddev.sh <hiddev node> <hidraw node> [iterations] [brightness]
+#
+# Set ASDCONTROL to the binary under test (default: ./asdcontrol). The brightness argument is passed verbatim, e.g.
+# +0 to benchmark a relative change which does not actually alter the brightness. Without it, the brightness is read.
+# The system call count needs strace; it is left out if strace is not installed.
+
+ASDCONTROL=${ASDCONTROL:-./asdcontrol}
+HIDDEV=$1
+HIDRAW=$2
+ITERATIONS=${3:-200}
+BRIGHTNESS=$4
+
+. "$(dirname "$0")/lib.sh"
+
+if [ -z "$HIDDEV" ] || [ -z "$HIDRAW" ]; then
+    echo "Usage: $0 <hiddev node> <hidraw node> [iterations] [brightness]" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/asdcontrol-hidraw.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+echo "path     syscalls  iterations  us/invocation"
+
+for DEVICE in "$HIDDEV" "$HIDRAW"; do
+    # Warm up the detection and brightness control caches first
+    "$ASDCONTROL" --silent --brief --no-daemon "$DEVICE" $BRIGHTNESS > /dev/null || exit 1
+
+    CALLS=$(syscalls "$ASDCONTROL" --silent --brief --no-daemon "$DEVICE" $BRIGHTNESS)
+    TIME=$(run "$ASDCONTROL" --silent --brief --no-daemon "$DEVICE" $BRIGHTNESS)
+
+    case "$DEVICE" in
+        *hidraw*) echo "hidraw   $CALLS  $ITERATIONS  $TIME" ;;
+        *) echo "hiddev   $CALLS  $ITERATIONS  $TIME" ;;
+    esac
+done
@@ -0,0 +1,84 @@
+#!/bin/bash
+#
+# Measures the latency of getting the brightness, setting it, changing it relatively and setting it in percent against
+# a simulated display, end to end and for each step of the HID access, from traces written by --record.
+#
+# Usage: bench/latency.sh [iterations]
+#
+# Set ASDCONTROL to the binary under test (default: ./asdcontrol) and SIM to the simulated display (default:
+# sim:studio,latency=500,jitter=100). Needs bash 5 for its clock.
+#
+# The output is tab separated, with a header line, one line per operation and phase:
+#   operation  get, set, setrel or percent
+#   phase      total (the whole invocation), open, devinfo, initreport, usage or report
+#   samples    invocations for total, calls otherwise
+#   p50_us p90_us p99_us max_us
+#              latency percentiles in microseconds
+#   calls      calls to the display per invocation: open, close and ioctls
+#   syscalls   system calls per invocation, if strace is installed
+#   ops_per_s  invocations per second
+
+ASDCONTROL=${ASDCONTROL:-./asdcontrol}
+SIM=${SIM:-sim:studio,latency=500,jitter=100}
+ITERATIONS=${1:-2000}
+
+. "$(dirname "$0")/lib.sh"
+
+if [ -z "$EPOCHREALTIME" ]; then
+    echo "$0 needs bash 5 or later" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/asdcontrol-latency.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+# The phase of each call, by its request
+PHASES='
+    $4 == open { print "open", $3 }
+    $4 == devinfo { print "devinfo", $3 }
+    $4 == initreport { print "initreport", $3 }
+    $4 == gusage || $4 == susage { print "usage", $3 }
+    $4 == greport || $4 == sreport { print "report", $3 }
+    { print "calls", 0 }
+'
+
+# Runs one operation
+#
+# $1 the name of the operation
+# $2 the brightness argument, if any
+benchmark() {
+    operation=$1
+    : > "$WORK/wall"
+    : > "$WORK/calls"
+
+    for ((i = 0; i < ITERATIONS; ++i)); do
+        start=${EPOCHREALTIME/[.,]/}
+        "$ASDCONTROL" --silent --brief --no-daemon --record="$WORK/trace" "$SIM" $2 > /dev/null || exit 1
+        end=${EPOCHREALTIME/[.,]/}
+        echo $((end - start)) >> "$WORK/wall"
+
+        trace_records "$WORK/trace" | awk $TRACE_REQUESTS "$PHASES" >> "$WORK/calls"
+    done
+
+    total=$(awk '{ sum += $1 } END { print sum }' "$WORK/wall")
+    calls=$(awk -v n="$ITERATIONS" '$1 == "calls" { ++count } END { printf "%.1f", count / n }' "$WORK/calls")
+
+    printf "%s\ttotal\t%s\t%s\t%s\t%s\t%s\n" "$operation" "$ITERATIONS" "$(percentiles < "$WORK/wall")" "$calls" \
+        "$(syscalls "$ASDCONTROL" --silent --brief --no-daemon "$SIM" $2)" \
+        "$(awk -v n="$ITERATIONS" -v total="$total" 'BEGIN { printf "%.0f", n * 1000000 / total }')"
+
+    for phase in open devinfo initreport usage report; do
+        awk -v phase=$phase '$1 == phase { print $2 }' "$WORK/calls" > "$WORK/phase"
+        calls=$(awk -v n="$ITERATIONS" 'END { printf "%.1f", NR / n }' "$WORK/phase")
+
+        printf "%s\t%s\t%s\t%s\t%s\t-\t-\n" "$operation" "$phase" "$(wc -l < "$WORK/phase")" \
+            "$(percentiles < "$WORK/phase")" "$calls"
+    done
+}
+
+printf "operation\tphase\tsamples\tp50_us\tp90_us\tp99_us\tmax_us\tcalls\tsyscalls\tops_per_s\n"
+
+benchmark get
+benchmark set 30000
+benchmark setrel +100
+benchmark percent 50%
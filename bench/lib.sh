@@ -0,0 +1,80 @@
+# Helpers shared by the scripts in this folder. Source it with:
+#
+#   . "$(dirname "$0")/lib.sh"
+
+# Trace files written by --record: a header, then one record per call of ten 32-bit words: time (2 words), duration,
+# request, display, thread, result, error, value and detail. See TraceHeader and TraceRecord in asdcontrol.cpp.
+TRACE_HEADER_SIZE=36
+TRACE_RECORD_SIZE=40
+
+# Requests as recorded: ioctls on Linux (see linux/hiddev.h), and the trace's own kinds of records
+TRACE_OPEN=4294901761
+TRACE_EVENT=4294901764
+HIDIOCGDEVINFO=2149337091
+HIDIOCINITREPORT=18437
+HIDIOCGUSAGE=3222816779
+HIDIOCSUSAGE=1075333132
+HIDIOCGUSAGES=3491514387
+HIDIOCSUSAGES=1344030740
+HIDIOCGREPORT=1074546695
+HIDIOCSREPORT=1074546696
+
+# The same as awk variables, for: awk $TRACE_REQUESTS '$4 == initreport { ... }'
+TRACE_REQUESTS="-v open=$TRACE_OPEN -v event=$TRACE_EVENT -v devinfo=$HIDIOCGDEVINFO -v initreport=$HIDIOCINITREPORT
+    -v gusage=$HIDIOCGUSAGE -v susage=$HIDIOCSUSAGE -v gusages=$HIDIOCGUSAGES -v susages=$HIDIOCSUSAGES
+    -v greport=$HIDIOCGREPORT -v sreport=$HIDIOCSREPORT"
+
+# Prints the records of a trace file, one line of ten numbers each: the request is $4, the display $5, the result $7
+#
+# $1 the trace file
+# $2 where the records start, in bytes (default: right after the header)
+trace_records() {
+    od -An -v -j"${2:-$TRACE_HEADER_SIZE}" -w$TRACE_RECORD_SIZE -t u4 "$1"
+}
+
+# Runs a command $ITERATIONS times and prints the mean wall clock time per invocation in microseconds. Exits if the
+# command fails.
+run() {
+    start=$(date +%s%N)
+    i=0
+
+    while [ $i -lt "$ITERATIONS" ]; do
+        "$@" > /dev/null || exit 1
+        i=$((i + 1))
+    done
+
+    end=$(date +%s%N)
+    echo $(( (end - start) / ITERATIONS / 1000 ))
+}
+
+# Prints the 50th, 90th, 99th and 100th percentile of the numbers on standard input, tab separated
+percentiles() {
+    sort -n | awk '
+        { values[NR] = $1 }
+        END {
+            if (!NR) {
+                print "-\t-\t-\t-"
+                exit
+            }
+
+            split("50 90 99", wanted, " ")
+
+            for (i = 1; i <= 3; ++i) {
+                rank = int(NR * wanted[i] / 100 + 0.5)
+                printf "%s\t", values[rank < 1 ? 1 : rank]
+            }
+
+            print values[NR]
+        }'
+}
+
+# Prints the system calls made by one invocation, or - if strace is not installed. Uses the scratch directory $WORK.
+syscalls() {
+    if ! command -v strace > /dev/null; then
+        echo "-"
+        return
+    fi
+
+    strace -f -c -o "$WORK/strace" "$@" > /dev/null 2>&1
+    awk '$NF == "total" { print $(NF - 2) }' "$WORK/strace"
+}
@@ -0,0 +1,104 @@
+#!/bin/bash
+#
+# Measures how one invocation scales with the number of displays it is given, from 1 to 64 simulated displays: the
+# total time, the skew between the first and the last display to be done, and the CPU time used, for getting, setting
+# and relatively setting the brightness of all of them. The "failing" operation sets the brightness while the first
+# display fails every call, to check that the others are not held up or abandoned.
+#
+# Usage: bench/scaling.sh [iterations] [display counts]
+#
+# Set ASDCONTROL to the binary under test (default: ./asdcontrol) and LATENCY to the latency of every simulated ioctl in
+# microseconds (default: 2000). The display counts default to "1 2 4 8 16 32 64".
+#
+# The output is tab separated, with a header line, one line per operation and number of displays:
+#   operation  get, set, setrel or failing
+#   displays   number of displays
+#   total_ms   mean wall clock time per invocation
+#   skew_us    mean time between the first and the last display being done
+#   cpu_ms     mean user and system CPU time per invocation
+#   done       mean number of displays whose brightness was got or set
+
+ASDCONTROL=${ASDCONTROL:-./asdcontrol}
+LATENCY=${LATENCY:-2000}
+ITERATIONS=${1:-20}
+COUNTS=${2:-1 2 4 8 16 32 64}
+
+. "$(dirname "$0")/lib.sh"
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/asdcontrol-scaling.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+TIMEFORMAT='%R %U %S'
+
+# Per display, when it was done: its last call in the trace. Prints the skew and the number of displays which had
+# their brightness got or set (their last HIDIOCGREPORT or HIDIOCSREPORT succeeded).
+analyse() {
+    trace_records "$1" | awk $TRACE_REQUESTS '
+        {
+            done_at = ($1 + $2 * 4294967296) / 1000 + $3
+
+            if (!($5 in last) || done_at > last[$5]) {
+                last[$5] = done_at
+            }
+
+            if ($4 == greport || $4 == sreport) {
+                ok[$5] = ($7 == 0)
+            }
+        }
+        END {
+            first = -1
+
+            for (display in last) {
+                if (first < 0 || last[display] < first) first = last[display]
+                if (last[display] > final) final = last[display]
+            }
+
+            for (display in ok) {
+                succeeded += ok[display]
+            }
+
+            printf "%d %d\n", final - first, succeeded
+        }'
+}
+
+# Runs one operation
+#
+# $1 the name of the operation
+# $2 the number of displays
+# $3 the brightness argument, if any
+# $4 options of the first display, if any
+benchmark() {
+    displays=()
+
+    for ((d = 0; d < $2; ++d)); do
+        displays+=("sim:studio,latency=$LATENCY,serial=$d$([ $d -eq 0 ] && echo "$4")")
+    done
+
+    : > "$WORK/results"
+
+    for ((i = 0; i < ITERATIONS; ++i)); do
+        { time "$ASDCONTROL" --silent --brief --no-daemon --record="$WORK/trace" "${displays[@]}" $3 \
+            > /dev/null 2>&1; } 2> "$WORK/time"
+        echo "$(cat "$WORK/time") $(analyse "$WORK/trace")" >> "$WORK/results"
+    done
+
+    awk -v operation="$1" -v displays="$2" '
+        { wall += $1; cpu += $2 + $3; skew += $4; done_ += $5 }
+        END {
+            printf "%s\t%d\t%.1f\t%.0f\t%.1f\t%.1f\n", operation, displays, wall * 1000 / NR, skew / NR,
+                cpu * 1000 / NR, done_ / NR
+        }' "$WORK/results"
+}
+
+printf "operation\tdisplays\ttotal_ms\tskew_us\tcpu_ms\tdone\n"
+
+for OPERATION in get set setrel failing; do
+    for COUNT in $COUNTS; do
+        case $OPERATION in
+            get) benchmark get "$COUNT" ;;
+            set) benchmark set "$COUNT" 30000 ;;
+            setrel) benchmark setrel "$COUNT" +100 ;;
+            failing) benchmark failing "$COUNT" 30000 ",fail=1" ;;
+        esac
+    done
+done
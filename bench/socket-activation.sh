@@ -0,0 +1,89 @@
+#!/bin/sh
+#
+# Checks that a socket activated daemon keeps its displays warm: starts the daemon the way systemd does, with a
+# listening socket passed in as file descriptor 3 (through tools/socket-activate), and asks it for the brightness of a
+# simulated display twice. The first request opens and initialises the display; the second one must not call
+# HIDIOCINITREPORT again. Then checks that the daemon exits after --idle-timeout without requests.
+#
+# Usage: bench/socket-activation.sh [simulated display]
+#
+# Run "make check-socket-activation" to build everything needed and run it. Set ASDCONTROL to the binary under test
+# (default: ./asdcontrol). Prints the HID calls of each request and exits with 1 if a check fails.
+
+ASDCONTROL=${ASDCONTROL:-./asdcontrol}
+ACTIVATE=tools/socket-activate
+DISPLAY_NAME=${1:-sim:studio}
+IDLE_TIMEOUT=2
+
+. "$(dirname "$0")/lib.sh"
+
+if [ ! -x "$ACTIVATE" ]; then
+    echo "$ACTIVATE not found; run make check-socket-activation" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/asdcontrol-activation.XXXXXX")
+SOCKET="$WORK/socket"
+TRACE="$WORK/trace"
+
+"$ACTIVATE" "$SOCKET" "$ASDCONTROL" --silent --daemon --no-cache --idle-timeout=$IDLE_TIMEOUT --record="$TRACE" &
+DAEMON=$!
+trap 'kill $DAEMON 2> /dev/null; rm -rf "$WORK"' EXIT
+
+# The socket exists once it's bound, before the daemon runs; requests wait in the backlog until it does
+while [ ! -S "$SOCKET" ]; do
+    sleep 0.01
+done
+
+FAILED=0
+
+# Asks the daemon for the brightness and prints the requests of the HID calls it made for it, one per line
+#
+# $1 the name of the request
+request() {
+    before=$(wc -c < "$TRACE")
+
+    if ! "$ASDCONTROL" --silent --brief --socket="$SOCKET" "$DISPLAY_NAME" > /dev/null; then
+        echo "$1: request failed" >&2
+        exit 1
+    fi
+
+    # The daemon writes the trace out after answering
+    trace_records "$TRACE" "$before" | awk '{ print $4 }' > "$WORK/$1"
+    echo "$1: $(wc -l < "$WORK/$1") calls, $(grep -cx $HIDIOCINITREPORT "$WORK/$1") HIDIOCINITREPORT"
+}
+
+# The header is written when the daemon starts
+while [ "$(wc -c < "$TRACE" 2> /dev/null || echo 0)" -lt $TRACE_HEADER_SIZE ]; do
+    sleep 0.01
+done
+
+request cold
+request warm
+
+if ! grep -qx $HIDIOCINITREPORT "$WORK/cold"; then
+    echo "The first request did not initialise the display" >&2
+    FAILED=1
+fi
+
+if grep -qx $HIDIOCINITREPORT "$WORK/warm"; then
+    echo "The second request initialised the display again" >&2
+    FAILED=1
+fi
+
+if [ ! -s "$WORK/warm" ]; then
+    echo "The second request did not reach the display" >&2
+    FAILED=1
+fi
+
+# Give it a little longer than the idle timeout
+sleep $((IDLE_TIMEOUT + 1))
+
+if kill -0 $DAEMON 2> /dev/null; then
+    echo "The daemon did not exit after $IDLE_TIMEOUT idle seconds" >&2
+    FAILED=1
+else
+    echo "idle: exited after $IDLE_TIMEOUT seconds"
+fi
+
+exit $FAILED
@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Compares the time from exec to exit and the peak memory use of the regular and the release build, for commands which
+# do little besides starting up: listing the supported displays, and getting and setting the brightness of a simulated
+# display.
+#
+# Usage: bench/startup.sh [iterations]
+#
+# Run "make bench-startup" to build everything needed first. Set BUILDS to compare other binaries (default:
+# "./asdcontrol ./asdcontrol-release").
+#
+# The output is tab separated, with a header line, one line per build and command: the exec to exit time percentiles
+# in microseconds, and the peak resident set size in KiB.
+
+BUILDS=${BUILDS:-./asdcontrol ./asdcontrol-release}
+ITERATIONS=${1:-1000}
+EXEC_STATS=tools/exec-stats
+
+. "$(dirname "$0")/lib.sh"
+
+if [ ! -x "$EXEC_STATS" ]; then
+    echo "$EXEC_STATS not found; run make bench-startup" >&2
+    exit 1
+fi
+
+printf "build\tcommand\titerations\tp50_us\tp90_us\tp99_us\tmax_us\tpeak_rss_kib\n"
+
+for BUILD in $BUILDS; do
+    # Leave a running daemon out of it
+    printf "%s\tlist\t%s\n" "$BUILD" "$("$EXEC_STATS" "$ITERATIONS" "$BUILD" --list-all)" || exit 1
+    printf "%s\tget\t%s\n" "$BUILD" \
+        "$("$EXEC_STATS" "$ITERATIONS" "$BUILD" --silent --no-daemon sim:studio)" || exit 1
+    printf "%s\tset\t%s\n" "$BUILD" \
+        "$("$EXEC_STATS" "$ITERATIONS" "$BUILD" --silent --no-daemon sim:studio 50%)" || exit 1
+done
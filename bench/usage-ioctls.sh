@@ -0,0 +1,74 @@
+#!/bin/bash
+#
+# Compares moving the brightness usages one at a time (HIDIOCGUSAGE, HIDIOCSUSAGE) with moving them all at once
+# (HIDIOCGUSAGES, HIDIOCSUSAGES): the calls to the display and the system calls of one invocation, and the latency of
+# getting and setting the brightness, for displays with one or more brightness usages.
+#
+# Usage: bench/usage-ioctls.sh [iterations] [displays]
+#
+# The displays default to simulated ones with 1, 2 and 4 brightness usages, each ioctl taking LATENCY microseconds
+# (default: 500). hiddev nodes work too, e.g. one made with "tools/fake-hiddev --usages=4". Set ASDCONTROL to the binary
+# under test (default: ./asdcontrol). Needs bash 5 for its clock.
+#
+# The output is tab separated, with a header line, one line per display, operation and way of moving the usages:
+#   display     the display
+#   operation   get or set
+#   ioctls      single or multi
+#   calls       calls to the display per invocation: open, close and ioctls
+#   usage       usage ioctls per invocation
+#   syscalls    system calls per invocation, if strace is installed
+#   p50_us p90_us p99_us max_us
+#               latency percentiles of the whole invocation in microseconds
+
+ASDCONTROL=${ASDCONTROL:-./asdcontrol}
+LATENCY=${LATENCY:-500}
+ITERATIONS=${1:-500}
+DISPLAYS=${2:-sim:xdr,latency=$LATENCY sim:xdr,latency=$LATENCY,usages=2 sim:xdr,latency=$LATENCY,usages=4}
+
+. "$(dirname "$0")/lib.sh"
+
+if [ -z "$EPOCHREALTIME" ]; then
+    echo "$0 needs bash 5 or later" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/asdcontrol-usage-ioctls.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+USAGE_IOCTLS='$4 == gusage || $4 == susage || $4 == gusages || $4 == susages'
+
+# Runs one operation
+#
+# $1 the display
+# $2 the name of the operation
+# $3 single or multi
+# $4 the brightness argument, if any
+benchmark() {
+    : > "$WORK/wall"
+    : > "$WORK/calls"
+
+    for ((i = 0; i < ITERATIONS; ++i)); do
+        start=${EPOCHREALTIME/[.,]/}
+        "$ASDCONTROL" --silent --brief --no-daemon --usage-ioctls="$3" --record="$WORK/trace" "$1" $4 > /dev/null ||
+            exit 1
+        end=${EPOCHREALTIME/[.,]/}
+        echo $((end - start)) >> "$WORK/wall"
+
+        trace_records "$WORK/trace" >> "$WORK/calls"
+    done
+
+    printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\n" "$1" "$2" "$3" \
+        "$(awk -v n="$ITERATIONS" 'END { printf "%.1f", NR / n }' "$WORK/calls")" \
+        "$(awk $TRACE_REQUESTS -v n="$ITERATIONS" "$USAGE_IOCTLS"' { ++count } END { printf "%.1f", count / n }' "$WORK/calls")" \
+        "$(syscalls "$ASDCONTROL" --silent --brief --no-daemon --usage-ioctls="$3" "$1" $4)" \
+        "$(percentiles < "$WORK/wall")"
+}
+
+printf "display\toperation\tioctls\tcalls\tusage\tsyscalls\tp50_us\tp90_us\tp99_us\tmax_us\n"
+
+for DISPLAY in $DISPLAYS; do
+    for IOCTLS in single multi; do
+        benchmark "$DISPLAY" get $IOCTLS
+        benchmark "$DISPLAY" set $IOCTLS 30000
+    done
+done
@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# Exercises the usbfs backend against the in-process fake usbfs (--fake-usbfs), so no display is needed: checks that
+# brightness changes survive a round trip through the SET_REPORT and GET_REPORT encoding, then reports the wall clock
+# time per invocation for reading, setting, and relatively changing the brightness.
+#
+# Usage: bench/usbfs-fake.sh [iterations]
+#
+# Set ASDCONTROL to the binary under test (default: ./asdcontrol).
+
+ASDCONTROL=${ASDCONTROL:-./asdcontrol}
+ITERATIONS=${1:-200}
+NODE=/dev/bus/usb/001/002
+
+. "$(dirname "$0")/lib.sh"
+
+STATE=$(mktemp "${TMPDIR:-/tmp}/asdcontrol-fake-usbfs.XXXXXX")
+trap 'rm -f "$STATE"' EXIT
+
+fake() {
+    "$ASDCONTROL" --silent --brief --no-daemon --fake-usbfs="$STATE" "$NODE" "$@"
+}
+
+# Sets the brightness, reads it back, and compares it with what we expect
+check() {
+    fake -- "$1" > /dev/null || exit 1
+    GOT=$(fake)
+
+    if [ "$GOT" != "$2" ]; then
+        echo "$1: expected $2, got '$GOT'" >&2
+        exit 1
+    fi
+}
+
+check 1000 1000
+check 50% 30200
+check +10% 36160
+check -100% 400
+check 100% 60000
+
+echo "operation  iterations  us/invocation"
+echo "get        $ITERATIONS  $(run fake)"
+echo "set        $ITERATIONS  $(run fake 50%)"
+echo "setrel     $ITERATIONS  $(run fake +0)"
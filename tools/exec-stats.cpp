@@ -0,0 +1,104 @@
+/*
+ * exec-stats -- Measures the startup cost of a program, for benchmarking ASDControl
+ * Copyright (c) 2023-2024 Nicholas K. Dionysopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/**
+ * Runs a command many times and prints the time from fork() to its exit, and its peak resident set size, without the
+ * overhead of a shell in between:
+ *
+ *   exec-stats <iterations> <command> [<arguments>...]
+ *
+ * Prints one tab separated line: iterations, p50, p90, p99 and maximum time in microseconds, and the largest peak RSS in
+ * KiB. The command's output is discarded. Exits with 1 if the command ever fails.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+static long long monotonic_us()
+{
+    struct timespec now;
+
+    clock_gettime ( CLOCK_MONOTONIC, &now );
+
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+int main ( int argc, char** argv )
+{
+    if ( argc < 3 || atoi ( argv[1] ) <= 0 ) {
+        fprintf ( stderr, "Usage: %s <iterations> <command> [<arguments>...]\n", argv[0] );
+        return 1;
+    }
+
+    int iterations = atoi ( argv[1] );
+    vector<long long> times;
+    long peak = 0;
+
+    for ( int i = 0; i < iterations; ++i ) {
+        long long start = monotonic_us();
+        pid_t child = fork();
+
+        if ( child < 0 ) {
+            perror ( "fork" );
+            return 1;
+        }
+
+        if ( child == 0 ) {
+            int null = open ( "/dev/null", O_WRONLY );
+
+            dup2 ( null, STDOUT_FILENO );
+            dup2 ( null, STDERR_FILENO );
+            execvp ( argv[2], argv + 2 );
+            _exit ( 127 );
+        }
+
+        struct rusage usage;
+        int status;
+
+        if ( wait4 ( child, &status, 0, &usage ) < 0 ) {
+            perror ( "wait4" );
+            return 1;
+        }
+
+        times.push_back ( monotonic_us() - start );
+        peak = max ( peak, usage.ru_maxrss );
+
+        if ( !WIFEXITED ( status ) || WEXITSTATUS ( status ) != 0 ) {
+            fprintf ( stderr, "%s failed with status %d\n", argv[2], status );
+            return 1;
+        }
+    }
+
+    sort ( times.begin(), times.end() );
+
+    printf ( "%d\t%lld\t%lld\t%lld\t%lld\t%ld\n", iterations, times[ times.size() * 50 / 100 ],
+             times[ times.size() * 90 / 100 ], times[ times.size() * 99 / 100 ], times.back(), peak );
+
+    return 0;
+}
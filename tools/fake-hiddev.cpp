@@ -0,0 +1,465 @@
+/*
+ * fake-hiddev -- A fake Apple display hiddev character device, for testing ASDControl
+ * Copyright (c) 2023-2024 Nicholas K. Dionysopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/**
+ * Exposes a character device which behaves like the hiddev node of an Apple Studio Display or Pro Display XDR, using
+ * CUSE (character devices in userspace). The unmodified asdcontrol binary can then be tested and benchmarked against
+ * it exactly as deployed.
+ *
+ * Usage: fake-hiddev [-f] [--name=hiddev99] [--model=studio|xdr] [--usages=<n>] [--latency=<us>] [--script=<file>]
+ *
+ * The brightness field has one usage, or as many as --usages gives, like a display with a backlight per zone. They are
+ * read and written one at a time with HIDIOCGUSAGE and HIDIOCSUSAGE, or all at once with HIDIOCGUSAGES and
+ * HIDIOCSUSAGES.
+ *
+ * The script file sets the latency of individual ioctls, one per line, e.g.
+ *   HIDIOCINITREPORT 40000
+ *   HIDIOCSREPORT    8000 2000
+ * where the optional third number is a random jitter, plus or minus. Lines starting with # are ignored.
+ *
+ * Needs access to /dev/cuse, which normally means root. Build it with "make fake-hiddev"; it needs libfuse3.
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include <cuse_lowlevel.h>
+#include <fuse_opt.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <linux/hiddev.h>
+
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+
+using namespace std;
+
+// USB HID usages the fake display reports
+const unsigned MONITOR_CONTROL           = 0x800001;
+const unsigned BRIGHTNESS_USAGE          = 0x820010;
+
+// The only report: feature report 1 holds the brightness
+const unsigned BRIGHTNESS_REPORT         = 1;
+
+/**
+ * Command line options
+ */
+struct Options {
+    char* name;
+    char* model;
+    char* script;
+    int   usages;
+    int   latency;
+};
+
+#define OPTION(t, p) { t, offsetof ( Options, p ), 1 }
+
+static const fuse_opt option_spec[] = {
+    OPTION ( "--name=%s", name ),
+    OPTION ( "--model=%s", model ),
+    OPTION ( "--script=%s", script ),
+    OPTION ( "--usages=%d", usages ),
+    OPTION ( "--latency=%d", latency ),
+    FUSE_OPT_END
+};
+
+/**
+ * Latency of an ioctl
+ */
+struct Latency {
+    int delay;
+    int jitter;
+
+    Latency()
+        : delay ( 0 )
+        , jitter ( 0 )
+    { }
+};
+
+/**
+ * The fake display
+ */
+struct FakeDisplay {
+    hiddev_devinfo         info;
+    int                    minimum;
+    int                    maximum;
+    int                    usages;
+    int                    brightness[ HID_MAX_MULTI_USAGES ];
+    int                    pending[ HID_MAX_MULTI_USAGES ];
+    Latency                latency;
+    map<string, Latency>   latencies;
+    mutex                  lock;
+    mt19937                random;
+};
+
+static FakeDisplay fake;
+
+/**
+ * Waits for the latency of an ioctl
+ *
+ * @param name the ioctl's name, as in linux/hiddev.h
+ */
+static void delay ( const char* name )
+{
+    map<string, Latency>::const_iterator it = fake.latencies.find ( name );
+    const Latency& latency = it == fake.latencies.end() ? fake.latency : it->second;
+    int microseconds = latency.delay;
+
+    if ( latency.jitter ) {
+        lock_guard<mutex> guard ( fake.lock );
+        uniform_int_distribution<int> variation ( -latency.jitter, latency.jitter );
+
+        microseconds += variation ( fake.random );
+    }
+
+    if ( microseconds > 0 ) {
+        usleep ( microseconds );
+    }
+}
+
+/**
+ * Checks that a report or usage reference points at the brightness
+ *
+ * @return Whether the reference is to feature report 1
+ */
+static bool is_brightness ( unsigned report_type, unsigned report_id )
+{
+    return report_type == HID_REPORT_TYPE_FEATURE && report_id == BRIGHTNESS_REPORT;
+}
+
+static void fake_open ( fuse_req_t req, fuse_file_info* fi )
+{
+    fuse_reply_open ( req, fi );
+}
+
+/**
+ * Answers the hiddev ioctls asdcontrol uses.
+ *
+ * CUSE copies the arguments in and out according to the direction and size encoded in each ioctl number, like the
+ * kernel does for the real driver. HIDIOCAPPLICATION and HIDIOCINITREPORT carry no data; their argument is the value
+ * itself.
+ */
+static void fake_ioctl ( fuse_req_t req, int cmd, void* arg, fuse_file_info*, unsigned flags, const void* in_buf,
+                         size_t in_bufsz, size_t )
+{
+    if ( flags & FUSE_IOCTL_COMPAT ) {
+        fuse_reply_err ( req, ENOSYS );
+        return;
+    }
+
+    switch ( ( unsigned ) cmd ) {
+    case HIDIOCGVERSION: {
+        int version = HID_VERSION;
+
+        delay ( "HIDIOCGVERSION" );
+        fuse_reply_ioctl ( req, 0, &version, sizeof ( version ) );
+        return;
+    }
+
+    case HIDIOCGDEVINFO:
+        delay ( "HIDIOCGDEVINFO" );
+        fuse_reply_ioctl ( req, 0, &fake.info, sizeof ( fake.info ) );
+        return;
+
+    case HIDIOCAPPLICATION:
+        delay ( "HIDIOCAPPLICATION" );
+
+        if ( ( uintptr_t ) arg != 0 ) {
+            fuse_reply_err ( req, EINVAL );
+        } else {
+            fuse_reply_ioctl ( req, MONITOR_CONTROL, 0, 0 );
+        }
+        return;
+
+    case HIDIOCINITREPORT:
+        delay ( "HIDIOCINITREPORT" );
+        fuse_reply_ioctl ( req, 0, 0, 0 );
+        return;
+
+    case HIDIOCGREPORTINFO: {
+        hiddev_report_info info;
+
+        if ( in_bufsz < sizeof ( info ) ) {
+            fuse_reply_err ( req, EINVAL );
+            return;
+        }
+
+        memcpy ( &info, in_buf, sizeof ( info ) );
+        delay ( "HIDIOCGREPORTINFO" );
+
+        // There is exactly one feature report
+        if ( info.report_type != HID_REPORT_TYPE_FEATURE ||
+                ( info.report_id != HID_REPORT_ID_FIRST && info.report_id != BRIGHTNESS_REPORT ) ) {
+            fuse_reply_err ( req, EINVAL );
+            return;
+        }
+
+        info.report_id = BRIGHTNESS_REPORT;
+        info.num_fields = 1;
+        fuse_reply_ioctl ( req, 0, &info, sizeof ( info ) );
+        return;
+    }
+
+    case HIDIOCGFIELDINFO: {
+        hiddev_field_info info;
+
+        if ( in_bufsz < sizeof ( info ) ) {
+            fuse_reply_err ( req, EINVAL );
+            return;
+        }
+
+        memcpy ( &info, in_buf, sizeof ( info ) );
+        delay ( "HIDIOCGFIELDINFO" );
+
+        if ( !is_brightness ( info.report_type, info.report_id ) || info.field_index != 0 ) {
+            fuse_reply_err ( req, EINVAL );
+            return;
+        }
+
+        info.maxusage = fake.usages;
+        info.flags = HID_FIELD_VARIABLE;
+        info.physical = 0;
+        info.logical = 0;
+        info.application = MONITOR_CONTROL;
+        info.logical_minimum = fake.minimum;
+        info.logical_maximum = fake.maximum;
+        info.physical_minimum = fake.minimum;
+        info.physical_maximum = fake.maximum;
+        info.unit_exponent = 0;
+        info.unit = 0;
+        fuse_reply_ioctl ( req, 0, &info, sizeof ( info ) );
+        return;
+    }
+
+    case HIDIOCGUCODE:
+    case HIDIOCGUSAGE:
+    case HIDIOCSUSAGE: {
+        hiddev_usage_ref usage;
+
+        if ( in_bufsz < sizeof ( usage ) ) {
+            fuse_reply_err ( req, EINVAL );
+            return;
+        }
+
+        memcpy ( &usage, in_buf, sizeof ( usage ) );
+        delay ( ( unsigned ) cmd == HIDIOCGUCODE ? "HIDIOCGUCODE"
+                : ( unsigned ) cmd == HIDIOCGUSAGE ? "HIDIOCGUSAGE" : "HIDIOCSUSAGE" );
+
+        if ( !is_brightness ( usage.report_type, usage.report_id ) || usage.field_index != 0 ||
+                usage.usage_index >= ( unsigned ) fake.usages ) {
+            fuse_reply_err ( req, EINVAL );
+            return;
+        }
+
+        lock_guard<mutex> guard ( fake.lock );
+
+        if ( ( unsigned ) cmd == HIDIOCSUSAGE ) {
+            fake.pending[ usage.usage_index ] = usage.value;
+            fuse_reply_ioctl ( req, 0, 0, 0 );
+            return;
+        }
+
+        usage.usage_code = BRIGHTNESS_USAGE;
+        usage.value = fake.brightness[ usage.usage_index ];
+        fuse_reply_ioctl ( req, 0, &usage, sizeof ( usage ) );
+        return;
+    }
+
+    case HIDIOCGUSAGES:
+    case HIDIOCSUSAGES: {
+        hiddev_usage_ref_multi multi;
+
+        if ( in_bufsz < sizeof ( multi ) ) {
+            fuse_reply_err ( req, EINVAL );
+            return;
+        }
+
+        memcpy ( &multi, in_buf, sizeof ( multi ) );
+        delay ( ( unsigned ) cmd == HIDIOCGUSAGES ? "HIDIOCGUSAGES" : "HIDIOCSUSAGES" );
+
+        // Like the kernel, refuse to go past the end of the field
+        if ( !is_brightness ( multi.uref.report_type, multi.uref.report_id ) || multi.uref.field_index != 0 ||
+                multi.num_values > HID_MAX_MULTI_USAGES ||
+                multi.uref.usage_index + multi.num_values > ( unsigned ) fake.usages ) {
+            fuse_reply_err ( req, EINVAL );
+            return;
+        }
+
+        lock_guard<mutex> guard ( fake.lock );
+
+        for ( unsigned i = 0; i < multi.num_values; ++i ) {
+            if ( ( unsigned ) cmd == HIDIOCSUSAGES ) {
+                fake.pending[ multi.uref.usage_index + i ] = multi.values[i];
+            } else {
+                multi.values[i] = fake.brightness[ multi.uref.usage_index + i ];
+            }
+        }
+
+        if ( ( unsigned ) cmd == HIDIOCSUSAGES ) {
+            fuse_reply_ioctl ( req, 0, 0, 0 );
+        } else {
+            fuse_reply_ioctl ( req, 0, &multi, sizeof ( multi ) );
+        }
+        return;
+    }
+
+    case HIDIOCGREPORT:
+    case HIDIOCSREPORT: {
+        hiddev_report_info info;
+
+        if ( in_bufsz < sizeof ( info ) ) {
+            fuse_reply_err ( req, EINVAL );
+            return;
+        }
+
+        memcpy ( &info, in_buf, sizeof ( info ) );
+        delay ( ( unsigned ) cmd == HIDIOCGREPORT ? "HIDIOCGREPORT" : "HIDIOCSREPORT" );
+
+        if ( !is_brightness ( info.report_type, info.report_id ) ) {
+            fuse_reply_err ( req, EINVAL );
+            return;
+        }
+
+        // Like the display, clamp what the report carries to the logical range
+        if ( ( unsigned ) cmd == HIDIOCSREPORT ) {
+            lock_guard<mutex> guard ( fake.lock );
+
+            for ( int i = 0; i < fake.usages; ++i ) {
+                fake.brightness[i] = fake.pending[i] < fake.minimum ? fake.minimum
+                                     : fake.pending[i] > fake.maximum ? fake.maximum : fake.pending[i];
+            }
+        }
+
+        fuse_reply_ioctl ( req, 0, 0, 0 );
+        return;
+    }
+
+    default:
+        fuse_reply_err ( req, EINVAL );
+    }
+}
+
+static const cuse_lowlevel_ops fake_ops = {
+    .init = 0,
+    .init_done = 0,
+    .destroy = 0,
+    .open = fake_open,
+    .read = 0,
+    .write = 0,
+    .flush = 0,
+    .release = 0,
+    .fsync = 0,
+    .ioctl = fake_ioctl,
+    .poll = 0,
+};
+
+/**
+ * Loads the per-ioctl latencies
+ *
+ * @param path the script file
+ *
+ * @return False if the file can't be read
+ */
+static bool load_script ( const char* path )
+{
+    FILE* file = fopen ( path, "re" );
+    char line[ 256 ], name[ 64 ];
+
+    if ( !file ) {
+        return false;
+    }
+
+    while ( fgets ( line, sizeof ( line ), file ) ) {
+        Latency latency;
+
+        if ( line[0] != '#' && sscanf ( line, "%63s %d %d", name, &latency.delay, &latency.jitter ) >= 2 ) {
+            fake.latencies[ name ] = latency;
+        }
+    }
+
+    fclose ( file );
+
+    return true;
+}
+
+int main ( int argc, char** argv )
+{
+    fuse_args args = FUSE_ARGS_INIT ( argc, argv );
+    Options options;
+
+    memset ( &options, 0, sizeof ( options ) );
+
+    if ( fuse_opt_parse ( &args, &options, option_spec, 0 ) < 0 ) {
+        return 1;
+    }
+
+    string model = options.model ? options.model : "studio";
+    string devname = string ( "DEVNAME=" ) + ( options.name ? options.name : "hiddev99" );
+
+    memset ( &fake.info, 0, sizeof ( fake.info ) );
+    fake.info.bustype = BUS_USB;
+    fake.info.busnum = 1;
+    fake.info.devnum = 99;
+    fake.info.ifnum = 7;
+    fake.info.vendor = 0x05ac;
+    fake.info.version = 0x0100;
+    fake.info.num_applications = 1;
+    fake.minimum = 400;
+    fake.maximum = 60000;
+    fake.usages = options.usages ? options.usages : 1;
+    fake.latency.delay = options.latency;
+
+    if ( fake.usages < 1 || fake.usages > HID_MAX_MULTI_USAGES ) {
+        fprintf ( stderr, "--usages must be between 1 and %d\n", HID_MAX_MULTI_USAGES );
+        return 1;
+    }
+
+    for ( int i = 0; i < fake.usages; ++i ) {
+        fake.brightness[i] = fake.pending[i] = 30200;
+    }
+
+    if ( model == "studio" ) {
+        fake.info.product = 0x1114;
+    } else if ( model == "xdr" ) {
+        fake.info.product = ( short ) 0x9243;
+    } else {
+        fprintf ( stderr, "Unknown model '%s'; use studio or xdr\n", model.c_str() );
+        return 1;
+    }
+
+    if ( options.script && !load_script ( options.script ) ) {
+        perror ( options.script );
+        return 1;
+    }
+
+    const char* dev_info_argv[] = { devname.c_str() };
+    cuse_info info;
+
+    memset ( &info, 0, sizeof ( info ) );
+    info.dev_info_argc = 1;
+    info.dev_info_argv = dev_info_argv;
+
+    return cuse_lowlevel_main ( args.argc, args.argv, &info, &fake_ops, 0 );
+}
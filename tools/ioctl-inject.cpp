@@ -0,0 +1,521 @@
+/*
+ * ioctl-inject -- Latency and fault injection for HID device access, for testing ASDControl
+ * Copyright (c) 2023-2024 Nicholas K. Dionysopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/**
+ * A preload library which intercepts open(), ioctl() and close() on HID device nodes, so that any asdcontrol binary
+ * can be run against a slow or flaky display:
+ *
+ *   LD_PRELOAD=tools/ioctl-inject.so INJECT_DELAY=2000 INJECT_ERRORS=EIO:0.05 ./asdcontrol /dev/usb/hiddev0 +10
+ *
+ * Everything is configured through the environment:
+ *
+ *   INJECT_PATHS        colon separated patterns of the device nodes to intercept (default: hiddev nodes)
+ *   INJECT_IOCTLS       comma separated ioctls to inject faults into, e.g. HIDIOCSREPORT (default: all)
+ *   INJECT_DELAY        latency added to every intercepted ioctl, in microseconds
+ *   INJECT_JITTER       random variation of the latency, plus or minus, in microseconds
+ *   INJECT_ERRORS       ioctl failures and their probabilities, e.g. EIO:0.05,EAGAIN:0.01,ENODEV:0.001
+ *   INJECT_OPEN_ERRORS  the same for open()
+ *   INJECT_HANG         probability of an ioctl hanging
+ *   INJECT_HANG_TIME    how long a hang lasts, in milliseconds; 0 (the default) hangs forever
+ *   INJECT_SEED         random seed, for reproducible runs
+ *   INJECT_LOG          file to append one line per intercepted call to:
+ *                       <monotonic ns> <tid> <call> <fd> <ioctl or path> <result> <errno> <microseconds> <fault>
+ *
+ * Build it with "make ioctl-inject".
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/hiddev.h>
+
+#include <atomic>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// File descriptors above this are never intercepted
+const int MAX_FD                         = 4096;
+
+/**
+ * An error to inject, and how often
+ */
+struct Fault {
+    int    error;
+    double rate;
+};
+
+typedef vector<Fault> FaultList;
+
+/**
+ * The configuration, read once when the library is loaded
+ */
+struct Config {
+    vector<string> paths;
+    vector<string> ioctls;
+    int            delay;
+    int            jitter;
+    FaultList      errors;
+    FaultList      open_errors;
+    double         hang;
+    int            hang_time;
+    unsigned       seed;
+    int            log;
+};
+
+// Constructed before setup() fills it in
+static Config config __attribute__ ( ( init_priority ( 101 ) ) );
+
+static int ( *real_open ) ( const char*, int, ... );
+static int ( *real_openat ) ( int, const char*, int, ... );
+static int ( *real_ioctl ) ( int, unsigned long, ... );
+static int ( *real_close ) ( int );
+
+// Which file descriptors are intercepted device nodes
+static atomic<bool> intercepted[ MAX_FD ];
+
+static atomic<unsigned> threads ( 0 );
+
+/**
+ * Names of the ioctls asdcontrol uses
+ */
+static const char* ioctl_name ( unsigned long request )
+{
+    switch ( request ) {
+    case HIDIOCGVERSION:
+        return "HIDIOCGVERSION";
+    case HIDIOCAPPLICATION:
+        return "HIDIOCAPPLICATION";
+    case HIDIOCGDEVINFO:
+        return "HIDIOCGDEVINFO";
+    case HIDIOCGSTRING:
+        return "HIDIOCGSTRING";
+    case HIDIOCINITREPORT:
+        return "HIDIOCINITREPORT";
+    case HIDIOCGREPORT:
+        return "HIDIOCGREPORT";
+    case HIDIOCSREPORT:
+        return "HIDIOCSREPORT";
+    case HIDIOCGREPORTINFO:
+        return "HIDIOCGREPORTINFO";
+    case HIDIOCGFIELDINFO:
+        return "HIDIOCGFIELDINFO";
+    case HIDIOCGUSAGE:
+        return "HIDIOCGUSAGE";
+    case HIDIOCSUSAGE:
+        return "HIDIOCSUSAGE";
+    case HIDIOCGUSAGES:
+        return "HIDIOCGUSAGES";
+    case HIDIOCSUSAGES:
+        return "HIDIOCSUSAGES";
+    case HIDIOCSFLAG:
+        return "HIDIOCSFLAG";
+    case HIDIOCGUCODE:
+        return "HIDIOCGUCODE";
+    }
+
+    return 0;
+}
+
+static vector<string> split ( const char* text, char separator )
+{
+    vector<string> parts;
+    string part;
+
+    for ( const char* c = text; *c; ++c ) {
+        if ( *c == separator ) {
+            parts.push_back ( part );
+            part.clear();
+        } else {
+            part += *c;
+        }
+    }
+
+    parts.push_back ( part );
+
+    return parts;
+}
+
+/**
+ * Parses a list of faults like EIO:0.05,EAGAIN:0.01
+ */
+static FaultList parse_faults ( const char* text )
+{
+    static const struct {
+        const char* name;
+        int         error;
+    } names[] = {
+        { "EIO", EIO }, { "EAGAIN", EAGAIN }, { "ENODEV", ENODEV }, { "EINTR", EINTR }, { "ETIMEDOUT", ETIMEDOUT },
+        { "EPIPE", EPIPE }, { "ENOENT", ENOENT }, { "EACCES", EACCES }, { "EBUSY", EBUSY }, { "EINVAL", EINVAL },
+    };
+    FaultList faults;
+
+    if ( !text ) {
+        return faults;
+    }
+
+    vector<string> items = split ( text, ',' );
+
+    for ( size_t i = 0; i < items.size(); ++i ) {
+        size_t colon = items[i].find ( ':' );
+        string name = items[i].substr ( 0, colon );
+        Fault fault;
+
+        fault.error = 0;
+        fault.rate = colon == string::npos ? 1 : atof ( items[i].c_str() + colon + 1 );
+
+        for ( size_t n = 0; n < sizeof ( names ) / sizeof ( names[0] ); ++n ) {
+            if ( name == names[n].name ) {
+                fault.error = names[n].error;
+            }
+        }
+
+        if ( !fault.error ) {
+            fault.error = atoi ( name.c_str() );
+        }
+
+        if ( fault.error > 0 ) {
+            faults.push_back ( fault );
+        } else {
+            fprintf ( stderr, "ioctl-inject: unknown error '%s'\n", name.c_str() );
+        }
+    }
+
+    return faults;
+}
+
+static int env_int ( const char* name, int fallback )
+{
+    const char* value = getenv ( name );
+
+    return value && *value ? atoi ( value ) : fallback;
+}
+
+/**
+ * Finds the real functions. Called when the library is loaded, and again by any call which comes first.
+ */
+static void resolve()
+{
+    real_open = ( int ( * ) ( const char*, int, ... ) ) dlsym ( RTLD_NEXT, "open" );
+    real_openat = ( int ( * ) ( int, const char*, int, ... ) ) dlsym ( RTLD_NEXT, "openat" );
+    real_ioctl = ( int ( * ) ( int, unsigned long, ... ) ) dlsym ( RTLD_NEXT, "ioctl" );
+    real_close = ( int ( * ) ( int ) ) dlsym ( RTLD_NEXT, "close" );
+}
+
+__attribute__ ( ( constructor ) ) static void setup()
+{
+    if ( !real_open ) {
+        resolve();
+    }
+
+    const char* paths = getenv ( "INJECT_PATHS" );
+    const char* ioctls = getenv ( "INJECT_IOCTLS" );
+    const char* hang = getenv ( "INJECT_HANG" );
+    const char* log = getenv ( "INJECT_LOG" );
+
+    config.paths = split ( paths && *paths ? paths : "/dev/usb/hiddev*:/dev/hiddev*", ':' );
+
+    if ( ioctls && *ioctls ) {
+        config.ioctls = split ( ioctls, ',' );
+    }
+
+    config.delay = env_int ( "INJECT_DELAY", 0 );
+    config.jitter = env_int ( "INJECT_JITTER", 0 );
+    config.errors = parse_faults ( getenv ( "INJECT_ERRORS" ) );
+    config.open_errors = parse_faults ( getenv ( "INJECT_OPEN_ERRORS" ) );
+    config.hang = hang ? atof ( hang ) : 0;
+    config.hang_time = env_int ( "INJECT_HANG_TIME", 0 );
+    config.seed = env_int ( "INJECT_SEED", ( int ) ( time ( 0 ) ^ getpid() ) );
+    config.log = log && *log ? real_open ( log, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 ) : -1;
+}
+
+/**
+ * The calling thread's random numbers, between 0 and 1
+ */
+static double chance()
+{
+    static thread_local mt19937 random ( config.seed + 7919 * threads++ );
+    static thread_local uniform_real_distribution<double> distribution ( 0, 1 );
+
+    return distribution ( random );
+}
+
+/**
+ * Picks the error to inject, if any
+ *
+ * @return The error number, or 0
+ */
+static int pick_fault ( const FaultList& faults )
+{
+    double dice = chance();
+
+    for ( size_t i = 0; i < faults.size(); ++i ) {
+        if ( dice < faults[i].rate ) {
+            return faults[i].error;
+        }
+
+        dice -= faults[i].rate;
+    }
+
+    return 0;
+}
+
+static long long now()
+{
+    timespec ts;
+
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_us ( long long microseconds )
+{
+    if ( microseconds <= 0 ) {
+        return;
+    }
+
+    timespec ts = { ( time_t ) ( microseconds / 1000000 ), ( long ) ( microseconds % 1000000 ) * 1000 };
+
+    while ( nanosleep ( &ts, &ts ) < 0 && errno == EINTR ) {
+    }
+}
+
+/**
+ * Appends one line to the log. Each line is written with a single write() so that lines from concurrent threads
+ * don't interleave.
+ */
+static void log_call ( long long start, const char* call, int fd, const char* request, int result, int error,
+                       int injected )
+{
+    if ( config.log < 0 ) {
+        return;
+    }
+
+    char line[ 256 ];
+    int length = snprintf ( line, sizeof ( line ), "%lld %ld %s %d %s %d %d %lld %s\n", start,
+                            ( long ) syscall ( SYS_gettid ), call, fd, request ? request : "-", result,
+                            result < 0 ? error : 0, ( now() - start ) / 1000,
+                            injected ? strerrorname_np ( injected ) : "-" );
+
+    if ( write ( config.log, line, length ) < 0 ) {
+        // Nothing sensible to do
+    }
+}
+
+static bool matches ( const char* path )
+{
+    for ( size_t i = 0; i < config.paths.size(); ++i ) {
+        if ( fnmatch ( config.paths[i].c_str(), path, 0 ) == 0 ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool is_intercepted ( int fd )
+{
+    return fd >= 0 && fd < MAX_FD && intercepted[ fd ];
+}
+
+/**
+ * Opens a file, injecting open() failures into device nodes
+ */
+static int open_device ( int dirfd, const char* path, int flags, mode_t mode )
+{
+    if ( !real_open ) {
+        resolve();
+    }
+
+    if ( !path || !matches ( path ) ) {
+        return dirfd == AT_FDCWD ? real_open ( path, flags, mode ) : real_openat ( dirfd, path, flags, mode );
+    }
+
+    long long start = now();
+    int fault = pick_fault ( config.open_errors );
+    int result;
+
+    if ( fault ) {
+        errno = fault;
+        result = -1;
+    } else {
+        result = dirfd == AT_FDCWD ? real_open ( path, flags, mode ) : real_openat ( dirfd, path, flags, mode );
+    }
+
+    int error = errno;
+
+    if ( result >= 0 && result < MAX_FD ) {
+        intercepted[ result ] = true;
+    }
+
+    log_call ( start, "open", result, path, result, error, fault );
+    errno = error;
+
+    return result;
+}
+
+extern "C" {
+
+int open ( const char* path, int flags, ... )
+{
+    mode_t mode = 0;
+
+    if ( flags & ( O_CREAT | O_TMPFILE ) ) {
+        va_list args;
+
+        va_start ( args, flags );
+        mode = va_arg ( args, mode_t );
+        va_end ( args );
+    }
+
+    return open_device ( AT_FDCWD, path, flags, mode );
+}
+
+int open64 ( const char* path, int flags, ... ) __attribute__ ( ( alias ( "open" ) ) );
+
+int __open_2 ( const char* path, int flags )
+{
+    return open_device ( AT_FDCWD, path, flags, 0 );
+}
+
+int openat ( int dirfd, const char* path, int flags, ... )
+{
+    mode_t mode = 0;
+
+    if ( flags & ( O_CREAT | O_TMPFILE ) ) {
+        va_list args;
+
+        va_start ( args, flags );
+        mode = va_arg ( args, mode_t );
+        va_end ( args );
+    }
+
+    return open_device ( dirfd, path, flags, mode );
+}
+
+int ioctl ( int fd, unsigned long request, ... )
+{
+    va_list args;
+
+    va_start ( args, request );
+    void* arg = va_arg ( args, void* );
+    va_end ( args );
+
+    if ( !real_ioctl ) {
+        resolve();
+    }
+
+    if ( !is_intercepted ( fd ) ) {
+        return real_ioctl ( fd, request, arg );
+    }
+
+    const char* name = ioctl_name ( request );
+    bool targeted = config.ioctls.empty();
+    long long start = now();
+    int fault = 0;
+
+    for ( size_t i = 0; i < config.ioctls.size() && name; ++i ) {
+        targeted = targeted || config.ioctls[i] == name;
+    }
+
+    if ( targeted ) {
+        long long delay = config.delay;
+
+        if ( config.jitter ) {
+            delay += ( long long ) ( ( chance() * 2 - 1 ) * config.jitter );
+        }
+
+        sleep_us ( delay );
+
+        if ( config.hang && chance() < config.hang ) {
+            if ( config.hang_time ) {
+                sleep_us ( config.hang_time * 1000LL );
+            } else {
+                for ( ;; ) {
+                    pause();
+                }
+            }
+        }
+
+        fault = pick_fault ( config.errors );
+    }
+
+    int result;
+
+    if ( fault ) {
+        errno = fault;
+        result = -1;
+    } else {
+        result = real_ioctl ( fd, request, arg );
+    }
+
+    int error = errno;
+    char number[ 24 ];
+
+    if ( !name ) {
+        snprintf ( number, sizeof ( number ), "0x%lx", request );
+        name = number;
+    }
+
+    log_call ( start, "ioctl", fd, name, result, error, fault );
+    errno = error;
+
+    return result;
+}
+
+int close ( int fd )
+{
+    if ( !real_close ) {
+        resolve();
+    }
+
+    if ( !is_intercepted ( fd ) ) {
+        return real_close ( fd );
+    }
+
+    long long start = now();
+
+    intercepted[ fd ] = false;
+
+    int result = real_close ( fd );
+    int error = errno;
+
+    log_call ( start, "close", fd, 0, result, error, 0 );
+    errno = error;
+
+    return result;
+}
+
+}
@@ -0,0 +1,82 @@
+/*
+ * socket-activate -- Passes a listening socket to a program like systemd does, for testing ASDControl
+ * Copyright (c) 2023-2024 Nicholas K. Dionysopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/**
+ * A stand-in for the service manager's side of socket activation:
+ *
+ *   socket-activate <socket path> <command> [<arguments>...]
+ *
+ * Binds and listens on a Unix stream socket at the path, then executes the command with the socket as file descriptor
+ * 3 and LISTEN_FDS=1 and LISTEN_PID set to its process ID, which stays ours across exec(). Any file already at the path
+ * is replaced.
+ *
+ * Build it with "make tools/socket-activate".
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+int main ( int argc, char** argv )
+{
+    if ( argc < 3 ) {
+        fprintf ( stderr, "Usage: %s <socket path> <command> [<arguments>...]\n", argv[0] );
+        return 1;
+    }
+
+    sockaddr_un address;
+
+    memset ( &address, 0, sizeof ( address ) );
+    address.sun_family = AF_UNIX;
+
+    if ( strlen ( argv[1] ) >= sizeof ( address.sun_path ) ) {
+        fprintf ( stderr, "%s: Socket path too long\n", argv[1] );
+        return 1;
+    }
+
+    strcpy ( address.sun_path, argv[1] );
+    unlink ( argv[1] );
+
+    int fd = socket ( AF_UNIX, SOCK_STREAM, 0 );
+
+    if ( fd < 0 || bind ( fd, ( sockaddr* ) &address, sizeof ( address ) ) < 0 || listen ( fd, 16 ) < 0 ) {
+        perror ( argv[1] );
+        return 1;
+    }
+
+    // SD_LISTEN_FDS_START
+    if ( fd != 3 && ( dup2 ( fd, 3 ) < 0 || close ( fd ) < 0 ) ) {
+        perror ( "dup2" );
+        return 1;
+    }
+
+    char pid[ 16 ];
+
+    snprintf ( pid, sizeof ( pid ), "%d", ( int ) getpid() );
+    setenv ( "LISTEN_FDS", "1", 1 );
+    setenv ( "LISTEN_PID", pid, 1 );
+
+    execvp ( argv[2], argv + 2 );
+    perror ( argv[2] );
+
+    return 127;
+}